@@ -2,132 +2,3767 @@
 
 #include <linux/fs.h>
 #include <linux/mm.h>
+#include <linux/file.h>
 #include <linux/bio.h>
 #include <linux/bvec.h>
 #include <linux/init.h>
 #include <linux/wait.h>
 #include <linux/stat.h>
 #include <linux/slab.h>
+#include <linux/list.h>
 #include <linux/numa.h>
 #include <linux/errno.h>
+#include <linux/fcntl.h>
+#include <linux/firmware.h>
+#include <linux/mutex.h>
+#include <linux/ktime.h>
 #include <linux/types.h>
 #include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/ioprio.h>
+#include <linux/io_uring/cmd.h>
+#include <linux/bitmap.h>
+#include <linux/crc32.h>
+#include <linux/io.h>
+#include <linux/of.h>
+#include <linux/of_reserved_mem.h>
+#include <linux/reboot.h>
+#include <linux/kthread.h>
 #include <linux/string.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/uaccess.h>
+#include <linux/capability.h>
+#include <linux/miscdevice.h>
+#include <linux/percpu.h>
+#include <linux/pagemap.h>
+#include <linux/shmem_fs.h>
+#include <linux/wait_bit.h>
+#include <linux/rcupdate.h>
+#include <linux/shrinker.h>
+#include <linux/sysfs.h>
 #include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#include <linux/xarray.h>
+#include <linux/zstd.h>
 #include <linux/moduleparam.h>
 #include <linux/spinlock_types.h>
+#include <asm/unaligned.h>
+#ifdef CONFIG_X86_64
+#include <asm/cpufeature.h>
+#include <asm/fpu/api.h>
+#endif
+
+#include "sbdd.h"
 
 #define SBDD_SECTOR_SHIFT       9
 #define SBDD_SECTOR_SIZE        (1 << SBDD_SECTOR_SHIFT)
 #define SBDD_MIB_SECTORS        (1 << (20 - SBDD_SECTOR_SHIFT))
+#define SBDD_PAGE_SECTORS       (PAGE_SIZE >> SBDD_SECTOR_SHIFT)
 #define SBDD_NAME               "sbdd"
+#define SBDD_MAX_HW_SECTORS     (16 * SBDD_MIB_SECTORS)
+#define SBDD_NT_MIN_KB          512
+#define SBDD_SIMD_MIN_KB        64
+#define SBDD_PARALLEL_CHUNK_KB  1024
+#define SBDD_LOCK_HOLD_KB       32
+#define SBDD_RESCHED_KB         256
+#define SBDD_QUEUE_DEPTH        128
+#define SBDD_PAGE_CACHE_MAX     1024
+#define SBDD_SHRINK_PROBE       128
+#define SBDD_SEED_ZSTD_BUF      (4 << 20)
+#define SBDD_SEED_ZSTD_WINDOW   (1UL << 27)
+#define SBDD_PRIO_WEIGHT_RT     8
+#define SBDD_PRIO_WEIGHT_BE     4
+#define SBDD_PRIO_WEIGHT_IDLE   1
+#define SBDD_PRIO_WEIGHT_MAX    1024
+#define SBDD_TUNABLE_MAX_KB     (1U << 20)
+
+/* Granularity of lazy zeroing of the vmalloc store */
+#define SBDD_ZERO_CHUNK_SHIFT   20
+#define SBDD_ZERO_CHUNK_SIZE    (1UL << SBDD_ZERO_CHUNK_SHIFT)
+
+/*
+The store is protected by striped locks rather than one lock: concurrent
+copies of different regions, e.g. the chunks of one large bio copied in
+parallel, do not serialize on a single cacheline. Stripes repeat every
+SBDD_LOCK_STRIPES * SBDD_STRIPE_SIZE bytes of the store.
+*/
+#define SBDD_STRIPE_SHIFT       16
+#define SBDD_STRIPE_SIZE        (1UL << SBDD_STRIPE_SHIFT)
+#define SBDD_LOCK_STRIPES       256
+
+/*
+The vmalloc store is made of segments so that teardown can hand them to
+several workers, vfree() of a single huge area runs on one CPU only.
+*/
+#define SBDD_SEG_SHIFT          30
+#define SBDD_SEG_SIZE           (1UL << SBDD_SEG_SHIFT)
+
+/*
+Where the data lives. vmalloc is a linear store of vmalloc segments
+allocated and zeroed at load. pages is sparse: a page is allocated on the first write into it and
+reads of never written pages return zeroes. shmem keeps the data in an
+internal tmpfs file, so cold pages can be swapped out under pressure; each
+page is copied under its folio lock instead of a data lock. memfd works the
+same way on a memfd a process attaches through the control device, the disk
+is only added then. phys is a linear store in a physical memory region kept
+from the kernel (memmap=), which survives kexec and is adopted as it is by
+the next module load.
+*/
+enum sbdd_store {
+	SBDD_STORE_VMALLOC,
+	SBDD_STORE_PAGES,
+	SBDD_STORE_SHMEM,
+	SBDD_STORE_MEMFD,
+	SBDD_STORE_PHYS,
+};
+
+static const char * const sbdd_store_names[] = {
+	[SBDD_STORE_VMALLOC] = "vmalloc",
+	[SBDD_STORE_PAGES] = "pages",
+	[SBDD_STORE_SHMEM] = "shmem",
+	[SBDD_STORE_MEMFD] = "memfd",
+	[SBDD_STORE_PHYS] = "phys",
+};
+
+/*
+First page of the phys region. The data follows it, a region whose header
+does not match the module parameters is formatted, i.e. zeroed. The clean
+flag is cleared while the disk is in use and set again at unload or reboot,
+so a load after a crash knows writes may have been torn.
+*/
+#define SBDD_PHYS_MAGIC         0x7362646470687973ULL   /* "sbddphys" */
+#define SBDD_PHYS_VERSION       2
+#define SBDD_PHYS_CLEAN         (1U << 0)
+
+/* Reserved memory node the region is taken from when phys_addr is unset */
+#define SBDD_PHYS_COMPATIBLE    "sbdd,phys"
+
+struct sbdd_phys_sb {
+	__le64                  magic;
+	__le32                  version;
+	__le32                  csum;           /* crc32 of the header, csum 0 */
+	__le64                  capacity;       /* sectors */
+	__le64                  data_offset;    /* bytes */
+	__le32                  flags;
+	__le32                  pad;
+};
+
+/* What the phys store found at load */
+enum sbdd_phys_state {
+	SBDD_PHYS_FORMATTED,
+	SBDD_PHYS_ADOPTED_CLEAN,
+	SBDD_PHYS_ADOPTED_DIRTY,
+};
+
+static const char * const sbdd_phys_state_names[] = {
+	[SBDD_PHYS_FORMATTED] = "formatted",
+	[SBDD_PHYS_ADOPTED_CLEAN] = "clean",
+	[SBDD_PHYS_ADOPTED_DIRTY] = "dirty",
+};
+
+/*
+How I/O reaches the driver. bio mode handles bios in ->submit_bio() with no
+blk-mq overhead. mq mode registers a tag set, so plugged submissions arrive
+as request lists in ->queue_rqs() and requests of polled queues are
+completed from ->poll(), both ending requests in batches.
+*/
+enum sbdd_queue_mode {
+	SBDD_QUEUE_BIO,
+	SBDD_QUEUE_MQ,
+};
+
+static const char * const sbdd_queue_mode_names[] = {
+	[SBDD_QUEUE_BIO] = "bio",
+	[SBDD_QUEUE_MQ] = "mq",
+};
+
+/*
+Queue features the disk can be given. The default profile leaves it
+non-rotational and out of the entropy pool and accepts REQ_NOWAIT bios.
+synchronous (I/O completes in the submitter's context) is not in it:
+parallel copies, plugs flushed from schedule() and the latency dispatchers
+all complete bios on other threads.
+*/
+enum sbdd_feature {
+	SBDD_FEAT_ROTATIONAL,
+	SBDD_FEAT_ADD_RANDOM,
+	SBDD_FEAT_NOWAIT,
+	SBDD_FEAT_STABLE_WRITES,
+	SBDD_FEAT_SYNCHRONOUS,
+	SBDD_FEAT_NR,
+};
+
+static const char * const sbdd_feature_names[] = {
+	[SBDD_FEAT_ROTATIONAL] = "rotational",
+	[SBDD_FEAT_ADD_RANDOM] = "add_random",
+	[SBDD_FEAT_NOWAIT] = "nowait",
+	[SBDD_FEAT_STABLE_WRITES] = "stable_writes",
+	[SBDD_FEAT_SYNCHRONOUS] = "synchronous",
+};
+
+static const blk_features_t sbdd_feature_flags[] = {
+	[SBDD_FEAT_ROTATIONAL] = BLK_FEAT_ROTATIONAL,
+	[SBDD_FEAT_ADD_RANDOM] = BLK_FEAT_ADD_RANDOM,
+	[SBDD_FEAT_NOWAIT] = BLK_FEAT_NOWAIT,
+	[SBDD_FEAT_STABLE_WRITES] = BLK_FEAT_STABLE_WRITES,
+	[SBDD_FEAT_SYNCHRONOUS] = BLK_FEAT_SYNCHRONOUS,
+};
+
+/*
+Service classes of emulated latency mode, from ioprio classes. Bios with no
+class set are best effort.
+*/
+enum sbdd_prio {
+	SBDD_PRIO_RT,
+	SBDD_PRIO_BE,
+	SBDD_PRIO_IDLE,
+	SBDD_PRIO_NR,
+};
+
+/*
+How the dispatchers pick the next bio. none serves all bios in arrival
+order, strict always serves the highest class with bios queued and
+weighted serves backlogged classes in proportion to their weights.
+*/
+enum sbdd_ioprio_policy {
+	SBDD_IOPRIO_NONE,
+	SBDD_IOPRIO_STRICT,
+	SBDD_IOPRIO_WEIGHTED,
+};
+
+static const char * const sbdd_ioprio_policy_names[] = {
+	[SBDD_IOPRIO_NONE] = "none",
+	[SBDD_IOPRIO_STRICT] = "strict",
+	[SBDD_IOPRIO_WEIGHTED] = "weighted",
+};
+
+/*
+How data is moved between bio pages and the store. Auto uses non-temporal
+stores for large writes, which are not read back soon and would only evict
+hot data from the cache, and SIMD loads/stores for large reads. The size
+thresholds apply to the whole bio and are tunable through sysfs.
+*/
+enum sbdd_copy_engine {
+	SBDD_COPY_AUTO,
+	SBDD_COPY_MEMCPY,
+	SBDD_COPY_NT,
+	SBDD_COPY_AVX2,
+	SBDD_COPY_AVX512,
+	SBDD_COPY_NR,
+};
+
+static const char * const sbdd_copy_engine_names[] = {
+	[SBDD_COPY_AUTO] = "auto",
+	[SBDD_COPY_MEMCPY] = "memcpy",
+	[SBDD_COPY_NT] = "nt",
+	[SBDD_COPY_AVX2] = "avx2",
+	[SBDD_COPY_AVX512] = "avx512",
+};
+
+/* Kept per cpu so that counting does not add a shared cacheline of its own */
+struct sbdd_stats {
+	u64                     lock_acquired;
+	u64                     lock_contended;
+	u64                     page_swaps;
+	u64                     plug_batches;
+	u64                     plug_bios;
+	u64                     vio_calls;
+	u64                     vio_vecs;
+	u64                     range_copies;
+	u64                     cloned_pages;
+	u64                     shrink_scans;
+	u64                     shrink_cached;
+	u64                     shrink_zero;
+	u64                     nowait_again;
+	u64                     prio_rt;
+	u64                     prio_be;
+	u64                     prio_idle;
+};
+
+struct sbdd_lock {
+	spinlock_t              lock;
+} ____cacheline_aligned_in_smp;
+
+struct sbdd_pbio;
+
+/* Part of a large bio, chunks are copied concurrently by copy_wq workers */
+struct sbdd_chunk {
+	struct work_struct      work;
+	struct sbdd_pbio        *pbio;
+	struct bvec_iter        iter;
+};
+
+struct sbdd_pbio {
+	struct bio              *bio;
+	atomic_t                pending;
+	int                     dir;
+	unsigned int            engine;
+	struct sbdd_chunk       chunks[];
+};
+
+struct sbdd_seg {
+	u8                      *data;
+	size_t                  size;
+	bool                    zero;
+	struct work_struct      work;
+};
+
+/* Per request driver data in mq mode */
+struct sbdd_cmd {
+	blk_status_t            status;
+	bool                    parked;
+};
+
+/* Requests of a poll queue wait here until ->poll() completes them */
+struct sbdd_hctx {
+	spinlock_t              lock;
+	struct list_head        done;
+};
+
+struct sbdd {
+	wait_queue_head_t       exitwait;
+	struct sbdd_lock        datalocks[SBDD_LOCK_STRIPES];
+	atomic_t                deleting;
+	atomic_t                refs_cnt;
+	sector_t                capacity;
+	unsigned int            store;
+	struct sbdd_seg         *segs;
+	unsigned long           nr_segs;
+	unsigned long           *zero_claimed;
+	unsigned long           *zero_done;
+	unsigned long           zero_chunks;
+	atomic_long_t           zeroed;
+	bool                    zero_complete;
+	ktime_t                 zero_start;
+	struct task_struct      **zero_threads;
+	unsigned int            nr_zero_threads;
+	struct xarray           pages;
+	atomic_long_t           nr_pages;
+	spinlock_t              page_cache_lock;
+	struct list_head        page_cache;
+	unsigned long           nr_cached;
+	unsigned long           shrink_cursor;
+	unsigned long           shrink_seen;
+	unsigned long           shrink_hits;
+	bool                    shrink_probe;
+	struct shrinker         *shrinker;
+	struct file             *shmem;
+	struct sbdd_phys_sb     *phys_sb;
+	u8                      *phys_data;
+	unsigned int            phys_state;
+	bool                    phys_reboot_nb;
+	bool                    disk_added;
+	struct mutex            ctl_lock;
+	bool                    ctl_registered;
+	bool                    mem_registered;
+	bool                    read_only;
+	atomic_t                mem_maps;
+	unsigned int            queue_mode;
+	struct blk_mq_tag_set   tag_set;
+	struct gendisk          *gd;
+	struct sbdd_stats __percpu *stats;
+	unsigned int            copy_engine;
+	unsigned int            copy_nt_min_kb;
+	unsigned int            copy_simd_min_kb;
+	unsigned int            parallel_min_kb;
+	unsigned int            parallel_chunk_kb;
+	unsigned int            lock_hold_kb;
+	unsigned int            resched_kb;
+	unsigned int            page_swap;
+	unsigned int            plug_batch;
+	struct workqueue_struct *copy_wq;
+	struct work_struct      init_work;
+	unsigned int            latency_us;
+	unsigned int            ioprio_policy;
+	unsigned int            prio_weight_rt;
+	unsigned int            prio_weight_be;
+	unsigned int            prio_weight_idle;
+	spinlock_t              lat_lock;
+	struct bio_list         lat_queues[SBDD_PRIO_NR];
+	unsigned int            lat_credits[SBDD_PRIO_NR];
+	wait_queue_head_t       lat_wait;
+	struct task_struct      **lat_threads;
+	unsigned int            nr_lat_threads;
+};
+
+/*
+State of one pass over a bio. Consecutive segments of the same stripe are
+copied under one lock acquisition, but never more than hold_max bytes, so
+that a large writer neither bounces the lock per segment nor keeps small
+readers of the stripe waiting for long. Every resched_max bytes a task
+context submitter drops the lock and offers the CPU.
+*/
+struct sbdd_xfer_ctx {
+	spinlock_t              *lock;
+	size_t                  held;
+	size_t                  hold_max;
+	size_t                  since_resched;
+	size_t                  resched_max;
+	bool                    can_resched;
+	bool                    page_swap;
+	gfp_t                   gfp;
+	int                     dir;
+	unsigned int            engine;
+	int                     err;
+};
+
+static struct sbdd              __sbdd = { 0 };
+static unsigned long            __sbdd_capacity_mib = 100;
+static char                     *__sbdd_store = "vmalloc";
+static char                     *__sbdd_queue_mode = "bio";
+static unsigned int             __sbdd_hw_queues;
+static unsigned int             __sbdd_poll_queues = 1;
+static unsigned int             __sbdd_queue_depth = SBDD_QUEUE_DEPTH;
+static bool                     __sbdd_lazy_zero;
+static unsigned int             __sbdd_zero_threads;
+static unsigned long            __sbdd_phys_addr;
+static unsigned long            __sbdd_phys_size;
+static char                     *__sbdd_image;
+static bool                     __sbdd_async_init;
+static bool                     __sbdd_no_part_scan;
+static char                     *__sbdd_features = "nowait";
+static unsigned int             __sbdd_io_min = PAGE_SIZE;
+static unsigned int             __sbdd_io_opt;
+static unsigned int             __sbdd_max_hw_kb = SBDD_MAX_HW_SECTORS >> 1;
+static unsigned int             __sbdd_latency_us;
+static unsigned int             __sbdd_latency_depth = 1;
+static char                     *__sbdd_ioprio_policy = "none";
+
+static spinlock_t *sbdd_datalock(size_t offset)
+{
+	size_t stripe = (offset >> SBDD_STRIPE_SHIFT) % SBDD_LOCK_STRIPES;
+
+	return &__sbdd.datalocks[stripe].lock;
+}
+
+/*
+The trylock costs nothing when the lock is free and tells us whether we had
+to wait for it, which is the number that shows how badly the data locks
+stop sbdd from scaling with cores.
+*/
+static void sbdd_lock_nested(spinlock_t *lock, int subclass)
+{
+	if (!spin_trylock(lock)) {
+		spin_lock_nested(lock, subclass);
+		this_cpu_inc(__sbdd.stats->lock_contended);
+	}
+	this_cpu_inc(__sbdd.stats->lock_acquired);
+}
+
+static void sbdd_lock(spinlock_t *lock)
+{
+	sbdd_lock_nested(lock, 0);
+}
+
+/* Stripes of two ranges are always taken in address order */
+static void sbdd_lock_pair(spinlock_t *a, spinlock_t *b)
+{
+	if (a == b) {
+		sbdd_lock(a);
+		return;
+	}
+
+	if (a > b)
+		swap(a, b);
+	sbdd_lock(a);
+	sbdd_lock_nested(b, SINGLE_DEPTH_NESTING);
+}
+
+static void sbdd_unlock_pair(spinlock_t *a, spinlock_t *b)
+{
+	spin_unlock(a);
+	if (a != b)
+		spin_unlock(b);
+}
+
+static void sbdd_ctx_unlock(struct sbdd_xfer_ctx *ctx)
+{
+	if (ctx->lock) {
+		spin_unlock(ctx->lock);
+		ctx->lock = NULL;
+	}
+}
+
+static void sbdd_ctx_lock(struct sbdd_xfer_ctx *ctx, size_t offset)
+{
+	spinlock_t *lock = sbdd_datalock(offset);
+
+	if (ctx->lock == lock && ctx->held < ctx->hold_max)
+		return;
+
+	sbdd_ctx_unlock(ctx);
+	sbdd_lock(lock);
+	ctx->lock = lock;
+	ctx->held = 0;
+}
+
+static void sbdd_put(void)
+{
+	if (atomic_dec_and_test(&__sbdd.refs_cnt))
+		wake_up(&__sbdd.exitwait);
+}
+
+#ifdef CONFIG_X86_64
+/*
+Both copies move whole sectors, so len is always a multiple of the unrolled
+block and there is no tail to take care of. The FPU section is per segment:
+only the first kernel_fpu_begin() after a return from user space has to save
+the task's registers, the following ones are cheap.
+*/
+static void sbdd_copy_avx2(void *dst, const void *src, size_t len)
+{
+	kernel_fpu_begin();
+	for (; len; len -= 128, src += 128, dst += 128)
+		asm volatile("vmovdqu   (%0), %%ymm0\n"
+			     "vmovdqu 32(%0), %%ymm1\n"
+			     "vmovdqu 64(%0), %%ymm2\n"
+			     "vmovdqu 96(%0), %%ymm3\n"
+			     "vmovdqu %%ymm0,   (%1)\n"
+			     "vmovdqu %%ymm1, 32(%1)\n"
+			     "vmovdqu %%ymm2, 64(%1)\n"
+			     "vmovdqu %%ymm3, 96(%1)\n"
+			     : : "r" (src), "r" (dst) : "memory");
+	kernel_fpu_end();
+}
+
+static void sbdd_copy_avx512(void *dst, const void *src, size_t len)
+{
+	kernel_fpu_begin();
+	for (; len; len -= 256, src += 256, dst += 256)
+		asm volatile("vmovdqu64    (%0), %%zmm0\n"
+			     "vmovdqu64  64(%0), %%zmm1\n"
+			     "vmovdqu64 128(%0), %%zmm2\n"
+			     "vmovdqu64 192(%0), %%zmm3\n"
+			     "vmovdqu64 %%zmm0,    (%1)\n"
+			     "vmovdqu64 %%zmm1,  64(%1)\n"
+			     "vmovdqu64 %%zmm2, 128(%1)\n"
+			     "vmovdqu64 %%zmm3, 192(%1)\n"
+			     : : "r" (src), "r" (dst) : "memory");
+	kernel_fpu_end();
+}
+
+static bool sbdd_copy_engine_supported(unsigned int engine)
+{
+	switch (engine) {
+	case SBDD_COPY_AVX2:
+		return boot_cpu_has(X86_FEATURE_AVX2) &&
+		       cpu_has_xfeatures(XFEATURE_MASK_SSE | XFEATURE_MASK_YMM, NULL);
+	case SBDD_COPY_AVX512:
+		return boot_cpu_has(X86_FEATURE_AVX512F) &&
+		       cpu_has_xfeatures(XFEATURE_MASK_SSE | XFEATURE_MASK_YMM |
+					 XFEATURE_MASK_AVX512, NULL);
+	default:
+		return true;
+	}
+}
+#else
+static bool sbdd_copy_engine_supported(unsigned int engine)
+{
+	return engine != SBDD_COPY_AVX2 && engine != SBDD_COPY_AVX512;
+}
+#endif
+
+/* Resolves auto for a bio of the given size and direction */
+static unsigned int sbdd_copy_engine(unsigned int size, int dir)
+{
+	unsigned int engine = READ_ONCE(__sbdd.copy_engine);
+
+	if (engine != SBDD_COPY_AUTO)
+		return engine;
+
+	if (dir && size >> 10 >= READ_ONCE(__sbdd.copy_nt_min_kb))
+		return SBDD_COPY_NT;
+
+	if (!dir && size >> 10 >= READ_ONCE(__sbdd.copy_simd_min_kb)) {
+		if (sbdd_copy_engine_supported(SBDD_COPY_AVX512))
+			return SBDD_COPY_AVX512;
+		if (sbdd_copy_engine_supported(SBDD_COPY_AVX2))
+			return SBDD_COPY_AVX2;
+	}
+
+	return SBDD_COPY_MEMCPY;
+}
+
+static void sbdd_copy(void *dst, const void *src, size_t len,
+		      unsigned int engine)
+{
+	switch (engine) {
+	case SBDD_COPY_NT:
+		memcpy_flushcache(dst, src, len);
+		/*
+		Non-temporal stores are weakly ordered, without the fence they
+		could become visible after the unlock or the bio completion.
+		*/
+		wmb();
+		return;
+#ifdef CONFIG_X86_64
+	case SBDD_COPY_AVX2:
+		if (irq_fpu_usable()) {
+			sbdd_copy_avx2(dst, src, len);
+			return;
+		}
+		break;
+	case SBDD_COPY_AVX512:
+		if (irq_fpu_usable()) {
+			sbdd_copy_avx512(dst, src, len);
+			return;
+		}
+		break;
+#endif
+	default:
+		break;
+	}
+
+	memcpy(dst, src, len);
+}
+
+/* Returns the address of offset in the store, NULL for a sparse hole */
+static void *sbdd_store_addr(size_t offset)
+{
+	struct page *page;
+
+	if (__sbdd.store == SBDD_STORE_VMALLOC)
+		return __sbdd.segs[offset >> SBDD_SEG_SHIFT].data +
+		       (offset & (SBDD_SEG_SIZE - 1));
+	if (__sbdd.store == SBDD_STORE_PHYS)
+		return __sbdd.phys_data + offset;
+
+	page = xa_load(&__sbdd.pages, offset >> PAGE_SHIFT);
+	return page ? page_address(page) + offset_in_page(offset) : NULL;
+}
+
+/* How many bytes from offset on are contiguous and under the same lock */
+static size_t sbdd_store_span(size_t offset)
+{
+	size_t span = SBDD_STRIPE_SIZE - (offset & (SBDD_STRIPE_SIZE - 1));
+
+	if (__sbdd.store != SBDD_STORE_VMALLOC &&
+	    __sbdd.store != SBDD_STORE_PHYS)
+		span = min_t(size_t, span, PAGE_SIZE - offset_in_page(offset));
+
+	return span;
+}
+
+/*
+With lazy_zero the vmalloc store is allocated without zeroing and zeroed in
+SBDD_ZERO_CHUNK_SIZE chunks, either by background threads or by the first
+bio which touches a chunk, whichever comes first. Whoever sets the claimed
+bit zeroes the chunk, everybody else waits for its done bit. Returns -EAGAIN
+instead of waiting when the caller must not sleep.
+*/
+static int sbdd_zero_chunk(unsigned long idx, bool may_sleep)
+{
+	size_t offset = idx << SBDD_ZERO_CHUNK_SHIFT;
+	size_t size = (size_t)__sbdd.capacity << SBDD_SECTOR_SHIFT;
+
+	if (test_bit_acquire(idx, __sbdd.zero_done))
+		return 0;
+
+	if (test_and_set_bit(idx, __sbdd.zero_claimed)) {
+		if (!may_sleep)
+			return -EAGAIN;
+		wait_var_event(&__sbdd.zero_done,
+			       test_bit_acquire(idx, __sbdd.zero_done));
+		return 0;
+	}
+
+	/* Chunks never cross a segment */
+	memset(sbdd_store_addr(offset), 0,
+	       min_t(size_t, SBDD_ZERO_CHUNK_SIZE, size - offset));
+
+	smp_mb__before_atomic();
+	set_bit(idx, __sbdd.zero_done);
+	smp_mb__after_atomic();
+	wake_up_var(&__sbdd.zero_done);
+
+	if (atomic_long_inc_return(&__sbdd.zeroed) == __sbdd.zero_chunks) {
+		WRITE_ONCE(__sbdd.zero_complete, true);
+		pr_info("zeroed in %lld ms\n",
+			ktime_ms_delta(ktime_get(), __sbdd.zero_start));
+	}
+
+	return 0;
+}
+
+/* Makes sure the store range a bio is about to copy is zeroed */
+static int sbdd_zero_range(struct sbdd_xfer_ctx *ctx, size_t offset,
+			   size_t len)
+{
+	unsigned long idx, last;
+	int ret;
+
+	if (READ_ONCE(__sbdd.zero_complete) || !len)
+		return 0;
+
+	idx = offset >> SBDD_ZERO_CHUNK_SHIFT;
+	last = min((offset + len - 1) >> SBDD_ZERO_CHUNK_SHIFT,
+		   __sbdd.zero_chunks - 1);
+
+	for (; idx <= last; idx++) {
+		if (test_bit_acquire(idx, __sbdd.zero_done))
+			continue;
+
+		/* Neither zeroing nor waiting for it is done under a data lock */
+		sbdd_ctx_unlock(ctx);
+		ret = sbdd_zero_chunk(idx, ctx->can_resched &&
+				      gfpflags_allow_blocking(ctx->gfp));
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/* Thread i of nr zeroes the i-th slice of the store at the lowest priority */
+static int sbdd_zero_thread(void *data)
+{
+	unsigned long i = (unsigned long)data;
+	unsigned long idx = i * __sbdd.zero_chunks / __sbdd.nr_zero_threads;
+	unsigned long end = (i + 1) * __sbdd.zero_chunks / __sbdd.nr_zero_threads;
+
+	set_user_nice(current, MAX_NICE);
+
+	for (; idx < end && !kthread_should_stop(); idx++) {
+		/* Chunks claimed by a bio are zeroed there, do not wait for it */
+		if (!test_bit(idx, __sbdd.zero_claimed))
+			sbdd_zero_chunk(idx, false);
+		cond_resched();
+	}
+
+	return 0;
+}
+
+static int sbdd_zero_start(void)
+{
+	unsigned int nr = __sbdd_zero_threads ?: num_online_cpus();
+	struct task_struct *t;
+	unsigned int i = 0;
+	int cpu;
+
+	__sbdd.zero_chunks = DIV_ROUND_UP((size_t)__sbdd.capacity <<
+					  SBDD_SECTOR_SHIFT, SBDD_ZERO_CHUNK_SIZE);
+	__sbdd.zero_claimed = bitmap_zalloc(__sbdd.zero_chunks, GFP_KERNEL);
+	__sbdd.zero_done = bitmap_zalloc(__sbdd.zero_chunks, GFP_KERNEL);
+	__sbdd.zero_threads = kcalloc(nr, sizeof(*__sbdd.zero_threads),
+				      GFP_KERNEL);
+	if (!__sbdd.zero_claimed || !__sbdd.zero_done || !__sbdd.zero_threads)
+		return -ENOMEM;
+
+	nr = min_t(unsigned long, nr, __sbdd.zero_chunks);
+	__sbdd.nr_zero_threads = nr;
+	__sbdd.zero_start = ktime_get();
+
+	/* Threads are spread round robin over the online cpus */
+	cpu = cpumask_first(cpu_online_mask);
+	for (i = 0; i < nr; i++) {
+		t = kthread_create_on_cpu(sbdd_zero_thread, (void *)(unsigned long)i,
+					  cpu, "sbdd_zero/%u");
+		if (IS_ERR(t))
+			return PTR_ERR(t);
+
+		/* Keeps the task around for kthread_stop() if it is done by then */
+		get_task_struct(t);
+		__sbdd.zero_threads[i] = t;
+		wake_up_process(t);
+
+		cpu = cpumask_next(cpu, cpu_online_mask);
+		if (cpu >= nr_cpu_ids)
+			cpu = cpumask_first(cpu_online_mask);
+	}
+
+	return 0;
+}
+
+static void sbdd_zero_stop(void)
+{
+	unsigned int i;
+
+	for (i = 0; __sbdd.zero_threads && i < __sbdd.nr_zero_threads; i++) {
+		if (!__sbdd.zero_threads[i])
+			continue;
+		kthread_stop(__sbdd.zero_threads[i]);
+		put_task_struct(__sbdd.zero_threads[i]);
+	}
+
+	kfree(__sbdd.zero_threads);
+	bitmap_free(__sbdd.zero_claimed);
+	bitmap_free(__sbdd.zero_done);
+}
+
+static void sbdd_seg_alloc_work(struct work_struct *work)
+{
+	struct sbdd_seg *seg = container_of(work, struct sbdd_seg, work);
+
+	seg->data = seg->zero ? vzalloc(seg->size) : vmalloc(seg->size);
+}
+
+/*
+Segments are allocated and zeroed concurrently by unbound workers, spread
+round robin over the online nodes so the store is interleaved between them.
+*/
+static int sbdd_segs_alloc(bool zero)
+{
+	size_t size = (size_t)__sbdd.capacity << SBDD_SECTOR_SHIFT;
+	int node = first_online_node;
+	struct sbdd_seg *seg;
+	unsigned long i;
+
+	__sbdd.nr_segs = DIV_ROUND_UP(size, SBDD_SEG_SIZE);
+	__sbdd.segs = kvcalloc(__sbdd.nr_segs, sizeof(*__sbdd.segs), GFP_KERNEL);
+	if (!__sbdd.segs)
+		return -ENOMEM;
+
+	for (i = 0; i < __sbdd.nr_segs; i++) {
+		seg = &__sbdd.segs[i];
+		seg->size = min_t(size_t, SBDD_SEG_SIZE, size - i * SBDD_SEG_SIZE);
+		seg->zero = zero;
+		INIT_WORK(&seg->work, sbdd_seg_alloc_work);
+		queue_work_node(node, __sbdd.copy_wq, &seg->work);
+
+		node = next_online_node(node);
+		if (node == MAX_NUMNODES)
+			node = first_online_node;
+	}
+
+	for (i = 0; i < __sbdd.nr_segs; i++)
+		flush_work(&__sbdd.segs[i].work);
+
+	for (i = 0; i < __sbdd.nr_segs; i++)
+		if (!__sbdd.segs[i].data)
+			return -ENOMEM;
+
+	return 0;
+}
+
+static void sbdd_seg_free_work(struct work_struct *work)
+{
+	kvfree_rcu_mightsleep(container_of(work, struct sbdd_seg, work)->data);
+}
+
+/*
+Segments are handed concurrently, each by an unbound worker of the node its
+pages came from, to kvfree_rcu(), which vfree()s them later from kernel
+workqueues. No module code runs then, so unload only waits for the hand
+over, not for the memory to be released.
+*/
+static void sbdd_segs_free(void)
+{
+	ktime_t start = ktime_get();
+	struct sbdd_seg *seg;
+	unsigned long i;
+	int node;
+
+	for (i = 0; i < __sbdd.nr_segs; i++) {
+		seg = &__sbdd.segs[i];
+		if (!seg->data)
+			continue;
+
+		if (!__sbdd.copy_wq) {
+			kvfree_rcu_mightsleep(seg->data);
+			continue;
+		}
+
+		node = page_to_nid(vmalloc_to_page(seg->data));
+		INIT_WORK(&seg->work, sbdd_seg_free_work);
+		queue_work_node(node, __sbdd.copy_wq, &seg->work);
+	}
+
+	/* The work runs module code, it only queues the segment though */
+	for (i = 0; __sbdd.copy_wq && i < __sbdd.nr_segs; i++)
+		if (__sbdd.segs[i].data)
+			flush_work(&__sbdd.segs[i].work);
+
+	kvfree(__sbdd.segs);
+
+	/* tools/teardown-time.sh collects this one */
+	pr_info("released %lu segments in %lld us\n", __sbdd.nr_segs,
+		ktime_us_delta(ktime_get(), start));
+}
+
+static u32 sbdd_phys_csum(struct sbdd_phys_sb *sb)
+{
+	struct sbdd_phys_sb tmp = *sb;
+
+	tmp.csum = 0;
+	return crc32(~0, &tmp, sizeof(tmp));
+}
+
+static void sbdd_phys_set_clean(bool clean)
+{
+	struct sbdd_phys_sb *sb = __sbdd.phys_sb;
+	u32 flags = le32_to_cpu(sb->flags);
+
+	flags = clean ? flags | SBDD_PHYS_CLEAN : flags & ~SBDD_PHYS_CLEAN;
+	sb->flags = cpu_to_le32(flags);
+	sb->csum = cpu_to_le32(sbdd_phys_csum(sb));
+	wmb();
+}
+
+/* Without phys_addr the region comes from a "sbdd,phys" reserved-memory node */
+static int sbdd_phys_lookup(void)
+{
+	struct reserved_mem *rmem;
+	struct device_node *np;
+
+	if (__sbdd_phys_addr || !IS_ENABLED(CONFIG_OF_RESERVED_MEM))
+		return 0;
+
+	np = of_find_compatible_node(NULL, NULL, SBDD_PHYS_COMPATIBLE);
+	if (!np)
+		return -ENODEV;
+	rmem = of_reserved_mem_lookup(np);
+	of_node_put(np);
+	if (!rmem)
+		return -ENODEV;
+
+	__sbdd_phys_addr = rmem->base;
+	__sbdd_phys_size = rmem->size;
+	return 0;
+}
+
+/*
+Maps the phys region write back cached. The region must be out of the
+kernel's hands, e.g. memmap=<size>$<addr> on the command line of this and
+every kernel kexec'ed from it, or a no-map reserved-memory node. Contents
+left by a previous kernel or boot are adopted without a copy when the
+header matches, otherwise the region is formatted.
+*/
+static int sbdd_phys_map(void)
+{
+	struct sbdd_phys_sb *sb;
+	sector_t capacity;
+	int ret;
+
+	ret = sbdd_phys_lookup();
+	if (ret)
+		return ret;
+
+	if (!__sbdd_phys_size || !PAGE_ALIGNED(__sbdd_phys_addr) ||
+	    __sbdd_phys_size <= PAGE_SIZE + SBDD_SECTOR_SIZE)
+		return -EINVAL;
+
+	sb = memremap(__sbdd_phys_addr, __sbdd_phys_size, MEMREMAP_WB);
+	if (!sb)
+		return -ENOMEM;
+	__sbdd.phys_sb = sb;
+	__sbdd.phys_data = (u8 *)sb + PAGE_SIZE;
+
+	capacity = (__sbdd_phys_size - PAGE_SIZE) >> SBDD_SECTOR_SHIFT;
+	__sbdd.capacity = capacity;
+
+	if (le64_to_cpu(sb->magic) == SBDD_PHYS_MAGIC &&
+	    le32_to_cpu(sb->version) == SBDD_PHYS_VERSION &&
+	    le32_to_cpu(sb->csum) == sbdd_phys_csum(sb) &&
+	    le64_to_cpu(sb->capacity) == capacity &&
+	    le64_to_cpu(sb->data_offset) == PAGE_SIZE) {
+		if (le32_to_cpu(sb->flags) & SBDD_PHYS_CLEAN) {
+			__sbdd.phys_state = SBDD_PHYS_ADOPTED_CLEAN;
+			pr_info("adopted %llu sectors at %#lx\n",
+				(unsigned long long)capacity, __sbdd_phys_addr);
+		} else {
+			__sbdd.phys_state = SBDD_PHYS_ADOPTED_DIRTY;
+			pr_warn("adopted %llu sectors at %#lx, not shut down cleanly\n",
+				(unsigned long long)capacity, __sbdd_phys_addr);
+		}
+		/* Marked dirty once the disk is added, a failed load keeps the flag */
+		return 0;
+	}
+
+	pr_info("formatting %llu sectors at %#lx\n",
+		(unsigned long long)capacity, __sbdd_phys_addr);
+	memset(__sbdd.phys_data, 0, capacity << SBDD_SECTOR_SHIFT);
+
+	memset(sb, 0, PAGE_SIZE);
+	sb->magic = cpu_to_le64(SBDD_PHYS_MAGIC);
+	sb->version = cpu_to_le32(SBDD_PHYS_VERSION);
+	sb->capacity = cpu_to_le64(capacity);
+	sb->data_offset = cpu_to_le64(PAGE_SIZE);
+	__sbdd.phys_state = SBDD_PHYS_FORMATTED;
+	sbdd_phys_set_clean(false);
+	return 0;
+}
+
+/*
+A reboot or kexec without unloading the module counts as clean only if the
+device is quiesced: not open, not mapped through /dev/sbdd-mem and with no
+I/O in flight. The base reference is taken away then, so nothing can write
+into the region after the flag is set. Otherwise it stays dirty.
+*/
+static int sbdd_phys_reboot(struct notifier_block *nb, unsigned long action,
+			    void *data)
+{
+	struct gendisk *gd;
+	bool clean = false;
+
+	mutex_lock(&__sbdd.ctl_lock);
+	gd = __sbdd.gd;
+	if (__sbdd.disk_added && !atomic_read(&__sbdd.mem_maps) &&
+	    (!gd || !disk_openers(gd))) {
+		/* A deleted disk has drained already */
+		if (atomic_read(&__sbdd.deleting))
+			clean = !atomic_read(&__sbdd.refs_cnt);
+		else
+			clean = atomic_cmpxchg(&__sbdd.refs_cnt, 1, 0) == 1;
+
+		/* Opened in between, it may not write but is not shut down */
+		if (clean && gd && disk_openers(gd)) {
+			atomic_inc(&__sbdd.refs_cnt);
+			clean = false;
+		}
+	}
+	mutex_unlock(&__sbdd.ctl_lock);
+
+	if (clean)
+		sbdd_phys_set_clean(true);
+	else
+		pr_warn("phys region busy at reboot, left dirty\n");
+
+	return NOTIFY_DONE;
+}
+
+static struct notifier_block __sbdd_phys_reboot_nb = {
+	.notifier_call = sbdd_phys_reboot,
+};
+
+/*
+Pages the sparse store lets go of after a grace period are kept in a small
+cache for the next page swap or populate instead of going back to the page
+allocator. The shrinker empties it under memory pressure. The cache lock is
+taken from RCU callbacks, hence the irq safe locking.
+*/
+static struct page *sbdd_page_alloc(gfp_t gfp)
+{
+	struct page *page = NULL;
+	unsigned long flags;
+
+	spin_lock_irqsave(&__sbdd.page_cache_lock, flags);
+	if (__sbdd.nr_cached) {
+		page = list_first_entry(&__sbdd.page_cache, struct page, lru);
+		list_del(&page->lru);
+		__sbdd.nr_cached--;
+	}
+	spin_unlock_irqrestore(&__sbdd.page_cache_lock, flags);
+
+	if (!page)
+		return alloc_page(gfp);
+
+	if (gfp & __GFP_ZERO)
+		clear_page(page_address(page));
+	return page;
+}
+
+/* Frees up to nr cached pages, returns how many were freed */
+static unsigned long sbdd_page_cache_drain(unsigned long nr)
+{
+	unsigned long flags, freed = 0;
+	struct page *page, *tmp;
+	LIST_HEAD(list);
+
+	spin_lock_irqsave(&__sbdd.page_cache_lock, flags);
+	list_for_each_entry_safe(page, tmp, &__sbdd.page_cache, lru) {
+		if (freed == nr)
+			break;
+		list_move(&page->lru, &list);
+		freed++;
+	}
+	__sbdd.nr_cached -= freed;
+	spin_unlock_irqrestore(&__sbdd.page_cache_lock, flags);
+
+	list_for_each_entry_safe(page, tmp, &list, lru)
+		__free_page(page);
+
+	return freed;
+}
+
+static int sbdd_pages_populate(size_t offset, size_t len, gfp_t gfp)
+{
+	pgoff_t idx = offset >> PAGE_SHIFT;
+	pgoff_t last = (offset + len - 1) >> PAGE_SHIFT;
+	struct page *page, *cur;
+
+	for (; idx <= last; idx++) {
+		if (xa_load(&__sbdd.pages, idx))
+			continue;
+
+		page = sbdd_page_alloc(gfp | __GFP_ZERO);
+		if (!page)
+			return -ENOMEM;
+
+		cur = xa_cmpxchg(&__sbdd.pages, idx, NULL, page, gfp);
+		if (cur) {
+			__free_page(page);
+			if (xa_is_err(cur))
+				return xa_err(cur);
+			continue;
+		}
+		atomic_long_inc(&__sbdd.nr_pages);
+	}
+
+	return 0;
+}
+
+static void sbdd_pages_free(void)
+{
+	struct page *page;
+	unsigned long idx;
+
+	/* Pages replaced by writes may still wait for their grace period */
+	rcu_barrier();
+
+	/* A cloned page shows up once per slot and holds a reference for each */
+	xa_for_each(&__sbdd.pages, idx, page) {
+		set_page_private(page, 0);
+		__free_page(page);
+	}
+	xa_destroy(&__sbdd.pages);
+	sbdd_page_cache_drain(ULONG_MAX);
+}
+
+/* A page still referenced elsewhere, e.g. by a mapping, is only put */
+static void sbdd_page_free_rcu(struct rcu_head *head)
+{
+	struct page *page = container_of(head, struct page, rcu_head);
+	unsigned long flags;
+
+	if (page_ref_count(page) == 1) {
+		spin_lock_irqsave(&__sbdd.page_cache_lock, flags);
+		if (__sbdd.nr_cached < SBDD_PAGE_CACHE_MAX) {
+			list_add(&page->lru, &__sbdd.page_cache);
+			__sbdd.nr_cached++;
+			page = NULL;
+		}
+		spin_unlock_irqrestore(&__sbdd.page_cache_lock, flags);
+	}
+
+	if (page)
+		__free_page(page);
+}
+
+static void sbdd_page_drop_rcu(struct rcu_head *head)
+{
+	__free_page(container_of(head, struct page, rcu_head));
+}
+
+/*
+Range clones share pages of the sparse store between slots. page_private()
+counts the slots beyond the first one a page is in, it only changes under
+the xarray lock, and a shared page is never written in place: writers
+unshare it first. Sharing is set up with the stripe locks of both slots
+held, so a writer holding its stripe lock sees a stable count.
+*/
+static bool sbdd_page_shared(size_t offset)
+{
+	struct page *page = xa_load(&__sbdd.pages, offset >> PAGE_SHIFT);
+
+	return page && page_private(page);
+}
+
+/* Drops a slot's reference, called with the xarray lock held */
+static void sbdd_page_release(struct page *page)
+{
+	if (page_private(page)) {
+		set_page_private(page, page_private(page) - 1);
+		put_page(page);
+		return;
+	}
+
+	call_rcu(&page->rcu_head, sbdd_page_free_rcu);
+}
+
+/* Gives the slot of offset a private copy of its page if it is shared */
+static int sbdd_page_unshare(size_t offset, gfp_t gfp)
+{
+	pgoff_t idx = offset >> PAGE_SHIFT;
+	struct page *page = sbdd_page_alloc(gfp);
+	struct page *old;
+
+	if (!page)
+		return -ENOMEM;
+
+	xa_lock(&__sbdd.pages);
+	old = xa_load(&__sbdd.pages, idx);
+	if (!old || !page_private(old)) {
+		xa_unlock(&__sbdd.pages);
+		__free_page(page);
+		return 0;
+	}
+
+	/* Shared pages are immutable, the slot exists and needs no memory */
+	copy_page(page_address(page), page_address(old));
+	__xa_store(&__sbdd.pages, idx, page, gfp);
+	sbdd_page_release(old);
+	xa_unlock(&__sbdd.pages);
+	return 0;
+}
+
+/*
+Drops all zero pages of the sparse store, reads of the holes they leave
+return zeroes just the same. Walks up to nr slots on from where the last
+scan stopped. A slot whose data lock or the xarray lock is held by I/O is
+skipped rather than waited for; no allocation that may enter reclaim is
+made under those locks, so the walk itself may sleep. Writers find the
+hole under the stripe lock and populate it again.
+*/
+static unsigned long sbdd_reclaim_zero(unsigned long nr)
+{
+	unsigned long idx, freed = 0, scanned = 0;
+	spinlock_t *lock;
+	struct page *page;
+
+	/* Mappings and clones map or share pages, see the ref count check */
+	if (atomic_read(&__sbdd.mem_maps))
+		return 0;
+
+	idx = READ_ONCE(__sbdd.shrink_cursor);
+	xa_for_each_start(&__sbdd.pages, idx, page, idx) {
+		if (scanned++ == nr)
+			break;
+
+		lock = sbdd_datalock(idx << PAGE_SHIFT);
+		if (!spin_trylock(lock))
+			continue;
+		if (!spin_trylock(&__sbdd.pages.xa_lock)) {
+			spin_unlock(lock);
+			continue;
+		}
+
+		page = xa_load(&__sbdd.pages, idx);
+		if (page && !page_private(page) && page_ref_count(page) == 1 &&
+		    !memchr_inv(page_address(page), 0, PAGE_SIZE)) {
+			__xa_erase(&__sbdd.pages, idx);
+			atomic_long_dec(&__sbdd.nr_pages);
+			/* Straight back to the allocator, not to the page cache */
+			call_rcu(&page->rcu_head, sbdd_page_drop_rcu);
+			freed++;
+		}
+
+		xa_unlock(&__sbdd.pages);
+		spin_unlock(lock);
+		cond_resched();
+	}
+
+	/* A walk that reached the end starts over from the first slot */
+	WRITE_ONCE(__sbdd.shrink_cursor, scanned > nr ? idx : 0);
+
+	/* Decaying hit rate of the walks, see sbdd_shrink_count() */
+	scanned = min(scanned, nr);
+	WRITE_ONCE(__sbdd.shrink_seen, READ_ONCE(__sbdd.shrink_seen) / 2 + scanned);
+	WRITE_ONCE(__sbdd.shrink_hits, READ_ONCE(__sbdd.shrink_hits) / 2 + freed);
+	WRITE_ONCE(__sbdd.shrink_probe, false);
+	return freed;
+}
+
+/*
+Only cached pages and all zero pages can be given back. Counting zero pages
+would take a walk over the store, so their number is estimated from the
+hit rate of the recent walks. Writes since the last walk may have left new
+ones, then at least a small probe is offered so the estimate gets
+refreshed, and a store with no zero pages is not scanned over and over.
+*/
+static unsigned long sbdd_shrink_count(struct shrinker *shrinker,
+				       struct shrink_control *sc)
+{
+	unsigned long count = READ_ONCE(__sbdd.nr_cached);
+	unsigned long pages = atomic_long_read(&__sbdd.nr_pages);
+	unsigned long seen = READ_ONCE(__sbdd.shrink_seen);
+	unsigned long zero = 0;
+
+	if (atomic_read(&__sbdd.mem_maps))
+		return count ?: SHRINK_EMPTY;
+
+	if (seen)
+		zero = mult_frac(pages, min(READ_ONCE(__sbdd.shrink_hits), seen),
+				 seen);
+	if (READ_ONCE(__sbdd.shrink_probe))
+		zero = max(zero, min_t(unsigned long, pages, SBDD_SHRINK_PROBE));
+
+	count += zero;
+	return count ?: SHRINK_EMPTY;
+}
+
+/* Cached pages go first, they cost nothing to give back */
+static unsigned long sbdd_shrink_scan(struct shrinker *shrinker,
+				      struct shrink_control *sc)
+{
+	unsigned long cached, zero = 0;
+
+	cached = sbdd_page_cache_drain(sc->nr_to_scan);
+	if (cached < sc->nr_to_scan)
+		zero = sbdd_reclaim_zero(sc->nr_to_scan - cached);
+
+	this_cpu_inc(__sbdd.stats->shrink_scans);
+	this_cpu_add(__sbdd.stats->shrink_cached, cached);
+	this_cpu_add(__sbdd.stats->shrink_zero, zero);
+
+	return cached + zero ?: SHRINK_STOP;
+}
+
+static int sbdd_shrinker_register(void)
+{
+	__sbdd.shrinker = shrinker_alloc(0, SBDD_NAME);
+	if (!__sbdd.shrinker)
+		return -ENOMEM;
+
+	__sbdd.shrinker->count_objects = sbdd_shrink_count;
+	__sbdd.shrinker->scan_objects = sbdd_shrink_scan;
+	shrinker_register(__sbdd.shrinker);
+	return 0;
+}
+
+static bool sbdd_page_swappable(struct bio_vec *bvec, sector_t pos,
+				struct sbdd_xfer_ctx *ctx)
+{
+	return ctx->page_swap && bvec->bv_len == PAGE_SIZE &&
+	       !((pos << SBDD_SECTOR_SHIFT) & ~PAGE_MASK) &&
+	       pos + SBDD_PAGE_SECTORS <= __sbdd.capacity;
+}
+
+/*
+A full page write into the sparse store does not need to touch the current
+page at all. The data goes into a fresh page with no lock held, which is
+then published in place of the old one. Readers that already looked the old
+page up keep copying from it until their RCU read side section ends.
+*/
+static int sbdd_page_swap(struct bio_vec *bvec, sector_t pos,
+			  struct sbdd_xfer_ctx *ctx)
+{
+	struct page *page = sbdd_page_alloc(ctx->gfp);
+	struct page *old;
+	void *buff;
+
+	if (!page)
+		return -ENOMEM;
+
+	buff = bvec_kmap_local(bvec);
+	sbdd_copy(page_address(page), buff, PAGE_SIZE, ctx->engine);
+	kunmap_local(buff);
+
+	xa_lock(&__sbdd.pages);
+	old = __xa_store(&__sbdd.pages, pos >> (PAGE_SHIFT - SBDD_SECTOR_SHIFT),
+			 page, ctx->gfp);
+	if (xa_is_err(old)) {
+		xa_unlock(&__sbdd.pages);
+		__free_page(page);
+		return xa_err(old);
+	}
+
+	if (old)
+		sbdd_page_release(old);
+	else
+		atomic_long_inc(&__sbdd.nr_pages);
+	xa_unlock(&__sbdd.pages);
+
+	this_cpu_inc(__sbdd.stats->page_swaps);
+	return 0;
+}
+
+/* Both shmem and memfd stores live in the page cache of a shmem file */
+static bool sbdd_store_file(void)
+{
+	return __sbdd.store == SBDD_STORE_SHMEM ||
+	       __sbdd.store == SBDD_STORE_MEMFD;
+}
+
+/* Copies to or from the locked folio, then unlocks and puts it */
+static void sbdd_shmem_copy(struct folio *folio, void *buff, size_t offset,
+			    size_t len, struct sbdd_xfer_ctx *ctx)
+{
+	void *addr = kmap_local_folio(folio, offset_in_folio(folio, offset));
+
+	if (ctx->dir) {
+		sbdd_copy(addr, buff, len, ctx->engine);
+		folio_mark_dirty(folio);
+	} else {
+		sbdd_copy(buff, addr, len, ctx->engine);
+	}
+	kunmap_local(addr);
+	folio_unlock(folio);
+
+	folio_mark_accessed(folio);
+	folio_put(folio);
+}
+
+/*
+Only a folio already uptodate in the page cache is copied, or zeroes for a
+read of a hole. Writes into holes, swapped out pages (value entries) and a
+contended folio lock would sleep, the caller gets -EAGAIN.
+*/
+static int sbdd_shmem_xfer_nowait(void *buff, size_t offset, size_t len,
+				  struct sbdd_xfer_ctx *ctx)
+{
+	struct address_space *mapping = __sbdd.shmem->f_mapping;
+	struct folio *folio;
+
+	folio = filemap_get_folio(mapping, offset >> PAGE_SHIFT);
+	if (IS_ERR(folio)) {
+		if (ctx->dir || xa_load(&mapping->i_pages, offset >> PAGE_SHIFT))
+			return -EAGAIN;
+		memset(buff, 0, len);
+		return 0;
+	}
+
+	if (!folio_trylock(folio)) {
+		folio_put(folio);
+		return -EAGAIN;
+	}
+
+	if (!folio_test_uptodate(folio)) {
+		folio_unlock(folio);
+		folio_put(folio);
+		return -EAGAIN;
+	}
+
+	sbdd_shmem_copy(folio, buff, offset, len, ctx);
+	return 0;
+}
+
+/*
+Copies len bytes within one page of the shmem store. Looking the folio up
+may allocate it or read it back from swap, so this sleeps unless the
+context may not block, see sbdd_shmem_xfer_nowait(). Reads of holes are
+zero filled without instantiating a page, a full read scan would allocate
+the whole capacity otherwise.
+*/
+static int sbdd_shmem_xfer(void *buff, size_t offset, size_t len,
+			   struct sbdd_xfer_ctx *ctx)
+{
+	struct address_space *mapping = __sbdd.shmem->f_mapping;
+	struct folio *folio;
+	int ret;
+
+	if (!gfpflags_allow_blocking(ctx->gfp))
+		return sbdd_shmem_xfer_nowait(buff, offset, len, ctx);
+
+	if (!ctx->dir) {
+		ret = shmem_get_folio(mapping->host, offset >> PAGE_SHIFT, 0,
+				      &folio, SGP_READ);
+		if (ret)
+			return ret;
+		if (!folio) {
+			memset(buff, 0, len);
+			return 0;
+		}
+		sbdd_shmem_copy(folio, buff, offset, len, ctx);
+		return 0;
+	}
+
+	folio = shmem_read_folio_gfp(mapping, offset >> PAGE_SHIFT,
+				     mapping_gfp_constraint(mapping, ctx->gfp));
+	if (IS_ERR(folio))
+		return PTR_ERR(folio);
+
+	folio_lock(folio);
+	sbdd_shmem_copy(folio, buff, offset, len, ctx);
+	return 0;
+}
+
+static sector_t sbdd_xfer(struct bio_vec* bvec, sector_t pos,
+			  struct sbdd_xfer_ctx *ctx)
+{
+	void *buff = kmap_local_page(bvec->bv_page) + bvec->bv_offset;
+	sector_t len = bvec->bv_len >> SBDD_SECTOR_SHIFT;
+	size_t offset;
+	size_t nbytes;
+	size_t done;
+	size_t chunk;
+
+	if (pos + len > __sbdd.capacity)
+		len = __sbdd.capacity - pos;
+
+	offset = pos << SBDD_SECTOR_SHIFT;
+	nbytes = len << SBDD_SECTOR_SHIFT;
+
+	/*
+	A segment which is not page aligned in the store may cross a stripe
+	or a page of the sparse store. Writes never see a hole, pages were
+	populated for them before the copy started.
+	*/
+	for (done = 0; done < nbytes; done += chunk, offset += chunk) {
+		void *addr;
+
+		chunk = min_t(size_t, nbytes - done, sbdd_store_span(offset));
+
+		if (sbdd_store_file()) {
+			ctx->err = sbdd_shmem_xfer(buff + done, offset, chunk, ctx);
+			if (ctx->err)
+				break;
+			continue;
+		}
+
+		sbdd_ctx_lock(ctx, offset);
+		rcu_read_lock();
+		addr = sbdd_store_addr(offset);
+
+		/*
+		Since the page was populated a clone may have shared it or the
+		shrinker may have dropped it for being all zeroes.
+		*/
+		if (ctx->dir && __sbdd.store == SBDD_STORE_PAGES &&
+		    (!addr || sbdd_page_shared(offset))) {
+			rcu_read_unlock();
+			sbdd_ctx_unlock(ctx);
+			ctx->err = sbdd_pages_populate(offset, chunk, ctx->gfp);
+			if (!ctx->err)
+				ctx->err = sbdd_page_unshare(offset, ctx->gfp);
+			if (ctx->err)
+				break;
+			chunk = 0;
+			continue;
+		}
+
+		if (ctx->dir)
+			sbdd_copy(addr, buff + done, chunk, ctx->engine);
+		else if (addr)
+			sbdd_copy(buff + done, addr, chunk, ctx->engine);
+		else
+			memset(buff + done, 0, chunk);
+
+		rcu_read_unlock();
+		ctx->held += chunk;
+	}
+	ctx->since_resched += nbytes;
+
+	pr_debug("pos=%6llu len=%4llu %s\n", pos, len,
+		 ctx->dir ? "written" : "read");
+
+	kunmap_local(buff);
+	return len;
+}
+
+/* Allocates the sparse store pages a write is going to copy into in place */
+static int sbdd_populate_bio(struct bio *bio, struct bvec_iter start,
+			     struct sbdd_xfer_ctx *ctx)
+{
+	sector_t pos = start.bi_sector;
+	struct bvec_iter iter;
+	struct bio_vec bvec;
+	int ret;
+
+	__bio_for_each_segment(bvec, bio, iter, start) {
+		sector_t len = bvec.bv_len >> SBDD_SECTOR_SHIFT;
+
+		if (pos + len > __sbdd.capacity)
+			len = __sbdd.capacity - pos;
+
+		if (len && !sbdd_page_swappable(&bvec, pos, ctx)) {
+			ret = sbdd_pages_populate(pos << SBDD_SECTOR_SHIFT,
+						  len << SBDD_SECTOR_SHIFT,
+						  ctx->gfp);
+			if (ret)
+				return ret;
+		}
+		pos += len;
+	}
+
+	return 0;
+}
+
+static void sbdd_ctx_set_dir(struct sbdd_xfer_ctx *ctx, int dir,
+			     unsigned int engine)
+{
+	ctx->dir = dir;
+	ctx->engine = engine;
+	/* New writes may have left zero pages for the shrinker to find */
+	if (dir && __sbdd.store == SBDD_STORE_PAGES &&
+	    !READ_ONCE(__sbdd.shrink_probe))
+		WRITE_ONCE(__sbdd.shrink_probe, true);
+	/* A swapped page would leave /dev/sbdd-mem mappings on the old one */
+	ctx->page_swap = dir && __sbdd.store == SBDD_STORE_PAGES &&
+			 READ_ONCE(__sbdd.page_swap) &&
+			 !atomic_read(&__sbdd.mem_maps);
+}
+
+/*
+may_sleep is false where the caller must not block, e.g. ->queue_rq()
+under RCU or a nonblocking SBDD_IOC_VIO.
+*/
+static void sbdd_ctx_init(struct sbdd_xfer_ctx *ctx, int dir,
+			  unsigned int engine, bool may_sleep)
+{
+	*ctx = (struct sbdd_xfer_ctx) {
+		.hold_max = (size_t)READ_ONCE(__sbdd.lock_hold_kb) << 10,
+		.resched_max = (size_t)READ_ONCE(__sbdd.resched_kb) << 10,
+		.can_resched = may_sleep && in_task(),
+		.gfp = may_sleep ? GFP_NOIO : GFP_NOWAIT,
+	};
+	sbdd_ctx_set_dir(ctx, dir, engine);
+}
+
+/* Copies the part of bio described by start, may leave ctx->lock held */
+static int sbdd_xfer_iter(struct sbdd_xfer_ctx *ctx, struct bio *bio,
+			  struct bvec_iter start)
+{
+	sector_t pos = start.bi_sector;
+	struct bvec_iter iter;
+	struct bio_vec bvec;
+	int ret = 0;
+
+	ret = sbdd_zero_range(ctx, start.bi_sector << SBDD_SECTOR_SHIFT,
+			      start.bi_size);
+	if (ret)
+		return ret;
+
+	if (ctx->dir && __sbdd.store == SBDD_STORE_PAGES) {
+		sbdd_ctx_unlock(ctx);
+		ret = sbdd_populate_bio(bio, start, ctx);
+		if (ret)
+			return ret;
+	}
+
+	__bio_for_each_segment(bvec, bio, iter, start) {
+		if (sbdd_page_swappable(&bvec, pos, ctx)) {
+			sbdd_ctx_unlock(ctx);
+			ret = sbdd_page_swap(&bvec, pos, ctx);
+			if (ret)
+				break;
+			pos += SBDD_PAGE_SECTORS;
+			ctx->since_resched += PAGE_SIZE;
+		} else {
+			pos += sbdd_xfer(&bvec, pos, ctx);
+			if (ctx->err) {
+				ret = ctx->err;
+				break;
+			}
+		}
+
+		if (ctx->can_resched &&
+		    ctx->since_resched >= ctx->resched_max) {
+			sbdd_ctx_unlock(ctx);
+			cond_resched();
+			ctx->since_resched = 0;
+		}
+	}
+
+	return ret;
+}
+
+/*
+A REQ_NOWAIT bio must not sleep: allocations do not wait for reclaim, the
+shmem store only serves cached folios, nobody waits for a chunk being
+zeroed and the copy does not reschedule. Whatever would have to sleep fails
+the bio with BLK_STS_AGAIN, io_uring then retries it from a context that
+may block. A plug batch reuses ctx for bios of either kind, the bio paths
+set it up with may_sleep.
+*/
+static void sbdd_ctx_set_bio(struct sbdd_xfer_ctx *ctx, struct bio *bio)
+{
+	if (bio->bi_opf & REQ_NOWAIT) {
+		ctx->gfp = GFP_NOWAIT;
+		ctx->can_resched = false;
+	} else {
+		ctx->gfp = GFP_NOIO;
+		ctx->can_resched = in_task();
+	}
+}
+
+static blk_status_t sbdd_bio_status(struct bio *bio, int ret)
+{
+	if ((bio->bi_opf & REQ_NOWAIT) && (ret == -EAGAIN || ret == -ENOMEM)) {
+		this_cpu_inc(__sbdd.stats->nowait_again);
+		return BLK_STS_AGAIN;
+	}
+
+	return errno_to_blk_status(ret);
+}
+
+static int sbdd_xfer_bio(struct bio *bio, struct bvec_iter start, int dir,
+			 unsigned int engine)
+{
+	struct sbdd_xfer_ctx ctx;
+	int ret;
+
+	sbdd_ctx_init(&ctx, dir, engine, true);
+	sbdd_ctx_set_bio(&ctx, bio);
+	ret = sbdd_xfer_iter(&ctx, bio, start);
+	sbdd_ctx_unlock(&ctx);
+
+	return ret;
+}
+
+static void sbdd_chunk_work(struct work_struct *work)
+{
+	struct sbdd_chunk *chunk = container_of(work, struct sbdd_chunk, work);
+	struct sbdd_pbio *pbio = chunk->pbio;
+	int ret;
+
+	ret = sbdd_xfer_bio(pbio->bio, chunk->iter, pbio->dir, pbio->engine);
+	if (ret)
+		WRITE_ONCE(pbio->bio->bi_status, sbdd_bio_status(pbio->bio, ret));
+
+	/* The last chunk completes the parent bio */
+	if (!atomic_dec_and_test(&pbio->pending))
+		return;
+
+	bio_endio(pbio->bio);
+	kfree(pbio);
+	sbdd_put();
+}
+
+/*
+A single large bio copied on the submitting CPU is limited by one core's
+memcpy bandwidth. Above parallel_min_kb the bio is cut into chunks which
+unbound workers of the submitter's node copy concurrently, the submitter
+copies the first chunk itself. Returns false if the bio is to be copied
+inline, the caller then still owns it.
+*/
+static bool sbdd_submit_parallel(struct bio *bio, int dir, unsigned int engine)
+{
+	unsigned int min_kb = READ_ONCE(__sbdd.parallel_min_kb);
+	u64 chunk = (u64)READ_ONCE(__sbdd.parallel_chunk_kb) << 10;
+	struct bvec_iter iter = bio->bi_iter;
+	struct sbdd_pbio *pbio;
+	unsigned int i, nr;
+	int node;
+
+	if (!min_kb || iter.bi_size >> 10 < min_kb || chunk >= iter.bi_size)
+		return false;
+
+	nr = DIV_ROUND_UP(iter.bi_size, chunk);
+	pbio = kmalloc(struct_size(pbio, chunks, nr),
+		       (bio->bi_opf & REQ_NOWAIT ? GFP_NOWAIT : GFP_NOIO) |
+		       __GFP_NOWARN);
+	if (!pbio)
+		return false;
+
+	pbio->bio = bio;
+	pbio->dir = dir;
+	pbio->engine = engine;
+	atomic_set(&pbio->pending, nr);
+
+	for (i = 0; i < nr; i++) {
+		struct sbdd_chunk *c = &pbio->chunks[i];
+
+		INIT_WORK(&c->work, sbdd_chunk_work);
+		c->pbio = pbio;
+		c->iter = iter;
+		c->iter.bi_size = min_t(u64, chunk, iter.bi_size);
+		bio_advance_iter(bio, &iter, c->iter.bi_size);
+	}
+
+	node = numa_node_id();
+	for (i = 1; i < nr; i++)
+		queue_work_node(node, __sbdd.copy_wq, &pbio->chunks[i].work);
+
+	sbdd_chunk_work(&pbio->chunks[0].work);
+	return true;
+}
+
+/*
+Bios submitted under a blk_plug are collected here and copied in one pass
+when the plug is flushed: one device reference for the whole batch, and
+adjacent bios keep the stripe lock they share instead of taking it again.
+*/
+struct sbdd_plug_cb {
+	struct blk_plug_cb      cb;
+	struct bio_list         bios;
+	struct work_struct      work;
+};
+
+static void sbdd_xfer_batch(struct bio_list *bios)
+{
+	struct bio_list done = BIO_EMPTY_LIST;
+	struct sbdd_xfer_ctx ctx;
+	struct bio *bio;
+	unsigned int nr = 0;
+
+	sbdd_ctx_init(&ctx, 0, SBDD_COPY_MEMCPY, true);
+	while ((bio = bio_list_pop(bios))) {
+		int dir = bio_data_dir(bio);
+		int ret;
+
+		sbdd_ctx_set_dir(&ctx, dir,
+				 sbdd_copy_engine(bio->bi_iter.bi_size, dir));
+		sbdd_ctx_set_bio(&ctx, bio);
+		ret = sbdd_xfer_iter(&ctx, bio, bio->bi_iter);
+		if (ret)
+			bio->bi_status = sbdd_bio_status(bio, ret);
+		bio_list_add(&done, bio);
+		nr++;
+	}
+	sbdd_ctx_unlock(&ctx);
+
+	/* Completion handlers run with no data lock held */
+	while ((bio = bio_list_pop(&done)))
+		bio_endio(bio);
+
+	this_cpu_inc(__sbdd.stats->plug_batches);
+	this_cpu_add(__sbdd.stats->plug_bios, nr);
+}
+
+static void sbdd_unplug_work(struct work_struct *work)
+{
+	struct sbdd_plug_cb *plug = container_of(work, struct sbdd_plug_cb, work);
+
+	sbdd_xfer_batch(&plug->bios);
+	kfree(plug);
+	sbdd_put();
+}
+
+static void sbdd_unplug(struct blk_plug_cb *cb, bool from_schedule)
+{
+	struct sbdd_plug_cb *plug = container_of(cb, struct sbdd_plug_cb, cb);
+	struct bio *bio;
+
+	if (atomic_read(&__sbdd.deleting) ||
+	    !atomic_inc_not_zero(&__sbdd.refs_cnt)) {
+		while ((bio = bio_list_pop(&plug->bios)))
+			bio_io_error(bio);
+		kfree(plug);
+		return;
+	}
+
+	/* The task is about to sleep and must not block, let a worker copy */
+	if (from_schedule) {
+		INIT_WORK(&plug->work, sbdd_unplug_work);
+		queue_work(__sbdd.copy_wq, &plug->work);
+		return;
+	}
+
+	sbdd_unplug_work(&plug->work);
+}
+
+/* Returns true if the bio was queued on the current plug */
+static bool sbdd_plug_bio(struct bio *bio)
+{
+	unsigned int parallel_min_kb = READ_ONCE(__sbdd.parallel_min_kb);
+	struct blk_plug_cb *cb;
+	struct sbdd_plug_cb *plug;
+
+	if (!current->plug || !READ_ONCE(__sbdd.plug_batch))
+		return false;
+
+	/* Those are better served by the parallel copy */
+	if (parallel_min_kb && bio->bi_iter.bi_size >> 10 >= parallel_min_kb)
+		return false;
+
+	cb = blk_check_plugged(sbdd_unplug, &__sbdd, sizeof(*plug));
+	if (!cb)
+		return false;
+
+	plug = container_of(cb, struct sbdd_plug_cb, cb);
+	bio_list_add(&plug->bios, bio);
+	return true;
+}
+
+static unsigned int sbdd_bio_prio(struct bio *bio)
+{
+	switch (IOPRIO_PRIO_CLASS(bio_prio(bio))) {
+	case IOPRIO_CLASS_RT:
+		return SBDD_PRIO_RT;
+	case IOPRIO_CLASS_IDLE:
+		return SBDD_PRIO_IDLE;
+	default:
+		return SBDD_PRIO_BE;
+	}
+}
+
+/*
+With latency_us set, bios are queued per class and served by latency_depth
+dispatcher threads, each taking latency_us per bio like a device with that
+many slots would. Once the queues build up, the ioprio policy decides
+whose bios wait. Returns true if the bio was taken.
+*/
+static bool sbdd_lat_queue(struct bio *bio)
+{
+	unsigned int prio = SBDD_PRIO_BE;
+
+	if (!READ_ONCE(__sbdd.latency_us) || !__sbdd.nr_lat_threads)
+		return false;
+
+	if (!atomic_inc_not_zero(&__sbdd.refs_cnt)) {
+		bio_io_error(bio);
+		return true;
+	}
+
+	/* Queueing is all the submitter waits for, dispatchers may sleep */
+	bio->bi_opf &= ~REQ_NOWAIT;
+
+	if (READ_ONCE(__sbdd.ioprio_policy) != SBDD_IOPRIO_NONE)
+		prio = sbdd_bio_prio(bio);
+
+	spin_lock(&__sbdd.lat_lock);
+	bio_list_add(&__sbdd.lat_queues[prio], bio);
+	spin_unlock(&__sbdd.lat_lock);
+
+	wake_up(&__sbdd.lat_wait);
+	return true;
+}
+
+static bool sbdd_lat_pending(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < SBDD_PRIO_NR; i++)
+		if (!bio_list_empty(&__sbdd.lat_queues[i]))
+			return true;
+
+	return false;
+}
+
+/*
+Weighted service is deficit round robin counted in bios: a backlogged class
+is served while it has credits, and when none of them has any left every
+class gets its weight again. A class with weight 0 is served only when all
+other classes are idle.
+*/
+static struct bio *sbdd_lat_pick(void)
+{
+	unsigned int weights[SBDD_PRIO_NR] = {
+		[SBDD_PRIO_RT] = READ_ONCE(__sbdd.prio_weight_rt),
+		[SBDD_PRIO_BE] = READ_ONCE(__sbdd.prio_weight_be),
+		[SBDD_PRIO_IDLE] = READ_ONCE(__sbdd.prio_weight_idle),
+	};
+	struct bio_list *queues = __sbdd.lat_queues;
+	unsigned int *credits = __sbdd.lat_credits;
+	unsigned int i, round;
+
+	lockdep_assert_held(&__sbdd.lat_lock);
+
+	if (READ_ONCE(__sbdd.ioprio_policy) == SBDD_IOPRIO_WEIGHTED) {
+		for (round = 0; round < 2; round++) {
+			for (i = 0; i < SBDD_PRIO_NR; i++) {
+				if (bio_list_empty(&queues[i]) || !credits[i])
+					continue;
+				credits[i]--;
+				return bio_list_pop(&queues[i]);
+			}
+			memcpy(credits, weights, sizeof(weights));
+		}
+	}
+
+	/* Strict, none (everything is in the best effort queue) and fallback */
+	for (i = 0; i < SBDD_PRIO_NR; i++)
+		if (!bio_list_empty(&queues[i]))
+			return bio_list_pop(&queues[i]);
+
+	return NULL;
+}
+
+static void sbdd_lat_count(struct bio *bio)
+{
+	switch (sbdd_bio_prio(bio)) {
+	case SBDD_PRIO_RT:
+		this_cpu_inc(__sbdd.stats->prio_rt);
+		break;
+	case SBDD_PRIO_IDLE:
+		this_cpu_inc(__sbdd.stats->prio_idle);
+		break;
+	default:
+		this_cpu_inc(__sbdd.stats->prio_be);
+		break;
+	}
+}
+
+static int sbdd_lat_thread(void *data)
+{
+	struct bio *bio;
+	int dir;
+	int ret;
+
+	while (!kthread_should_stop()) {
+		wait_event_idle(__sbdd.lat_wait,
+				sbdd_lat_pending() || kthread_should_stop());
+
+		spin_lock(&__sbdd.lat_lock);
+		bio = sbdd_lat_pick();
+		spin_unlock(&__sbdd.lat_lock);
+		if (!bio)
+			continue;
+
+		/* The emulated service time of one bio on this slot */
+		fsleep(READ_ONCE(__sbdd.latency_us));
+		sbdd_lat_count(bio);
+
+		dir = bio_data_dir(bio);
+		ret = sbdd_xfer_bio(bio, bio->bi_iter, dir,
+				    sbdd_copy_engine(bio->bi_iter.bi_size, dir));
+		if (ret)
+			bio->bi_status = sbdd_bio_status(bio, ret);
+		bio_endio(bio);
+		sbdd_put();
+	}
+
+	return 0;
+}
+
+static int sbdd_lat_start(void)
+{
+	struct task_struct *t;
+	unsigned int i;
+
+	__sbdd.lat_threads = kcalloc(__sbdd_latency_depth,
+				     sizeof(*__sbdd.lat_threads), GFP_KERNEL);
+	if (!__sbdd.lat_threads)
+		return -ENOMEM;
+
+	for (i = 0; i < __sbdd_latency_depth; i++) {
+		t = kthread_create(sbdd_lat_thread, NULL, "sbdd_lat/%u", i);
+		if (IS_ERR(t))
+			return PTR_ERR(t);
+		get_task_struct(t);
+		__sbdd.lat_threads[i] = t;
+		__sbdd.nr_lat_threads++;
+		wake_up_process(t);
+	}
+
+	return 0;
+}
+
+/* Called once no bio holds a reference, i.e. all queues are empty */
+static void sbdd_lat_stop(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < __sbdd.nr_lat_threads; i++) {
+		kthread_stop(__sbdd.lat_threads[i]);
+		put_task_struct(__sbdd.lat_threads[i]);
+	}
+
+	kfree(__sbdd.lat_threads);
+	__sbdd.lat_threads = NULL;
+	__sbdd.nr_lat_threads = 0;
+}
+
+static void sbdd_submit_bio(struct bio *bio)
+{
+	unsigned int engine;
+	int dir;
+	int ret;
+
+	bio = bio_split_to_limits(bio);
+	if (!bio)
+		return;
+
+	if (atomic_read(&__sbdd.deleting)) {
+		bio_io_error(bio);
+		return;
+	}
+
+	if (sbdd_lat_queue(bio))
+		return;
+
+	if (sbdd_plug_bio(bio))
+		return;
+
+	if (!atomic_inc_not_zero(&__sbdd.refs_cnt)) {
+		bio_io_error(bio);
+		return;
+	}
+
+	dir = bio_data_dir(bio);
+	engine = sbdd_copy_engine(bio->bi_iter.bi_size, dir);
+	if (sbdd_submit_parallel(bio, dir, engine))
+		return;
+
+	ret = sbdd_xfer_bio(bio, bio->bi_iter, dir, engine);
+	if (ret)
+		bio->bi_status = sbdd_bio_status(bio, ret);
+	bio_endio(bio);
+	sbdd_put();
+}
+
+static blk_status_t sbdd_xfer_rq(struct sbdd_xfer_ctx *ctx, struct request *rq)
+{
+	int dir = rq_data_dir(rq);
+	struct bio *bio;
+	int ret;
+
+	sbdd_ctx_set_dir(ctx, dir, sbdd_copy_engine(blk_rq_bytes(rq), dir));
+	__rq_for_each_bio(bio, rq) {
+		ret = sbdd_xfer_iter(ctx, bio, bio->bi_iter);
+		/* Another context is zeroing a chunk of rq, try again later */
+		if (ret == -EAGAIN)
+			return BLK_STS_RESOURCE;
+		if (ret)
+			return errno_to_blk_status(ret);
+	}
+
+	return BLK_STS_OK;
+}
+
+static void sbdd_complete_batch(struct io_comp_batch *iob)
+{
+	blk_mq_end_request_batch(iob);
+}
+
+/* Ends rq through iob when there is one and it takes the request */
+static void sbdd_end_rq(struct request *rq, blk_status_t status,
+			struct io_comp_batch *iob)
+{
+	if (!blk_mq_add_to_batch(rq, iob, status != BLK_STS_OK,
+				 sbdd_complete_batch))
+		blk_mq_end_request(rq, status);
+}
+
+/*
+Completes rq, or for a poll queue parks it until the submitter polls, so
+that polled submissions are ended in batches as well.
+*/
+static void sbdd_finish_rq(struct request *rq, blk_status_t status,
+			   struct io_comp_batch *iob)
+{
+	struct blk_mq_hw_ctx *hctx = rq->mq_hctx;
+	struct sbdd_hctx *shctx = hctx->driver_data;
+
+	if (hctx->type != HCTX_TYPE_POLL) {
+		sbdd_end_rq(rq, status, iob);
+		return;
+	}
+
+	blk_mq_rq_to_pdu(rq)->status = status;
+	spin_lock(&shctx->lock);
+	blk_mq_rq_to_pdu(rq)->parked = true;
+	list_add_tail(&rq->queuelist, &shctx->done);
+	spin_unlock(&shctx->lock);
+}
+
+/* The shmem store sleeps in its lookups, its queues are set up blocking */
+static bool sbdd_mq_may_sleep(void)
+{
+	return __sbdd.tag_set.flags & BLK_MQ_F_BLOCKING;
+}
+
+static blk_status_t sbdd_queue_rq(struct blk_mq_hw_ctx *hctx,
+				  const struct blk_mq_queue_data *bd)
+{
+	struct request *rq = bd->rq;
+	struct sbdd_xfer_ctx ctx;
+	blk_status_t status;
+
+	/* Same protection against teardown and reboot as a bio */
+	if (atomic_read(&__sbdd.deleting) ||
+	    !atomic_inc_not_zero(&__sbdd.refs_cnt))
+		return BLK_STS_IOERR;
+
+	sbdd_ctx_init(&ctx, 0, SBDD_COPY_MEMCPY, sbdd_mq_may_sleep());
+	status = sbdd_xfer_rq(&ctx, rq);
+	sbdd_ctx_unlock(&ctx);
+
+	/* Page allocation or lazy zeroing is in the way, let blk-mq retry */
+	if (status != BLK_STS_RESOURCE) {
+		blk_mq_start_request(rq);
+		sbdd_finish_rq(rq, status, NULL);
+		status = BLK_STS_OK;
+	}
+
+	sbdd_put();
+	return status;
+}
+
+/*
+A plug flush hands over the whole list. All requests are copied with one
+transfer context and one reference and ended with one batch, requests
+which could not be served are left in *rqlist for ->queue_rq(), so is the
+whole list once the disk is going away.
+*/
+static void sbdd_queue_rqs(struct request **rqlist)
+{
+	DEFINE_IO_COMP_BATCH(iob);
+	struct request *requeue = NULL;
+	struct sbdd_xfer_ctx ctx;
+	struct request *rq;
+	blk_status_t status;
+
+	if (atomic_read(&__sbdd.deleting) ||
+	    !atomic_inc_not_zero(&__sbdd.refs_cnt))
+		return;
+
+	sbdd_ctx_init(&ctx, 0, SBDD_COPY_MEMCPY, sbdd_mq_may_sleep());
+	while ((rq = rq_list_pop(rqlist))) {
+		status = sbdd_xfer_rq(&ctx, rq);
+		if (status == BLK_STS_RESOURCE) {
+			rq_list_add(&requeue, rq);
+			continue;
+		}
+
+		blk_mq_start_request(rq);
+		sbdd_finish_rq(rq, status, &iob);
+	}
+	sbdd_ctx_unlock(&ctx);
+	sbdd_put();
+
+	if (iob.req_list)
+		iob.complete(&iob);
+
+	*rqlist = requeue;
+}
+
+static int sbdd_poll(struct blk_mq_hw_ctx *hctx, struct io_comp_batch *iob)
+{
+	struct sbdd_hctx *shctx = hctx->driver_data;
+	struct request *rq, *next;
+	LIST_HEAD(list);
+	int nr = 0;
+
+	/* Whoever clears parked under the lock ends the request */
+	spin_lock(&shctx->lock);
+	list_for_each_entry(rq, &shctx->done, queuelist)
+		blk_mq_rq_to_pdu(rq)->parked = false;
+	list_splice_init(&shctx->done, &list);
+	spin_unlock(&shctx->lock);
+
+	list_for_each_entry_safe(rq, next, &list, queuelist) {
+		list_del_init(&rq->queuelist);
+		sbdd_end_rq(rq, blk_mq_rq_to_pdu(rq)->status, iob);
+		nr++;
+	}
+
+	return nr;
+}
+
+/*
+A request parked for ->poll() whose submitter stopped polling, e.g. was
+killed with IOPOLL I/O outstanding, is ended here. Anything else is still
+being copied and gets more time.
+*/
+static enum blk_eh_timer_return sbdd_timeout(struct request *rq)
+{
+	struct sbdd_hctx *shctx = rq->mq_hctx->driver_data;
+	struct sbdd_cmd *cmd = blk_mq_rq_to_pdu(rq);
+	bool parked;
+
+	spin_lock(&shctx->lock);
+	parked = cmd->parked;
+	if (parked) {
+		cmd->parked = false;
+		list_del_init(&rq->queuelist);
+	}
+	spin_unlock(&shctx->lock);
+
+	if (!parked)
+		return BLK_EH_RESET_TIMER;
+
+	blk_mq_end_request(rq, cmd->status);
+	return BLK_EH_DONE;
+}
+
+/* At teardown parked requests are ended right away, not after a timeout */
+static void sbdd_mq_end_parked(void)
+{
+	struct blk_mq_hw_ctx *hctx;
+	unsigned long i;
+
+	queue_for_each_hw_ctx(__sbdd.gd->queue, hctx, i)
+		if (hctx->type == HCTX_TYPE_POLL)
+			sbdd_poll(hctx, NULL);
+}
+
+static int sbdd_init_hctx(struct blk_mq_hw_ctx *hctx, void *data,
+			  unsigned int idx)
+{
+	struct sbdd_hctx *shctx;
+
+	shctx = kzalloc_node(sizeof(*shctx), GFP_KERNEL, hctx->numa_node);
+	if (!shctx)
+		return -ENOMEM;
+
+	spin_lock_init(&shctx->lock);
+	INIT_LIST_HEAD(&shctx->done);
+	hctx->driver_data = shctx;
+	return 0;
+}
+
+static void sbdd_exit_hctx(struct blk_mq_hw_ctx *hctx, unsigned int idx)
+{
+	kfree(hctx->driver_data);
+}
+
+static void sbdd_map_queues(struct blk_mq_tag_set *set)
+{
+	struct blk_mq_queue_map *map;
+	unsigned int i, offset = 0;
+
+	for (i = 0; i < set->nr_maps; i++) {
+		map = &set->map[i];
+		switch (i) {
+		case HCTX_TYPE_DEFAULT:
+			map->nr_queues = __sbdd_hw_queues;
+			break;
+		case HCTX_TYPE_POLL:
+			map->nr_queues = __sbdd_poll_queues;
+			break;
+		default:
+			map->nr_queues = 0;
+			continue;
+		}
+		map->queue_offset = offset;
+		offset += map->nr_queues;
+		blk_mq_map_queues(map);
+	}
+}
+
+static const struct blk_mq_ops __sbdd_mq_ops = {
+	.queue_rq = sbdd_queue_rq,
+	.queue_rqs = sbdd_queue_rqs,
+	.poll = sbdd_poll,
+	.timeout = sbdd_timeout,
+	.init_hctx = sbdd_init_hctx,
+	.exit_hctx = sbdd_exit_hctx,
+	.map_queues = sbdd_map_queues,
+};
+
+static u64 sbdd_stats_sum(size_t offset)
+{
+	u64 sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += *(u64 *)((void *)per_cpu_ptr(__sbdd.stats, cpu) + offset);
+
+	return sum;
+}
+
+#define SBDD_STAT_ATTR(_name)						\
+static ssize_t _name##_show(struct device *dev,				\
+			    struct device_attribute *attr, char *buf)	\
+{									\
+	size_t offset = offsetof(struct sbdd_stats, _name);		\
+									\
+	return sysfs_emit(buf, "%llu\n", sbdd_stats_sum(offset));	\
+}									\
+static DEVICE_ATTR_RO(_name)
+
+SBDD_STAT_ATTR(lock_acquired);
+SBDD_STAT_ATTR(lock_contended);
+SBDD_STAT_ATTR(page_swaps);
+SBDD_STAT_ATTR(plug_batches);
+SBDD_STAT_ATTR(plug_bios);
+SBDD_STAT_ATTR(vio_calls);
+SBDD_STAT_ATTR(vio_vecs);
+SBDD_STAT_ATTR(range_copies);
+SBDD_STAT_ATTR(cloned_pages);
+SBDD_STAT_ATTR(shrink_scans);
+SBDD_STAT_ATTR(shrink_cached);
+SBDD_STAT_ATTR(shrink_zero);
+SBDD_STAT_ATTR(nowait_again);
+SBDD_STAT_ATTR(prio_rt);
+SBDD_STAT_ATTR(prio_be);
+SBDD_STAT_ATTR(prio_idle);
+
+static ssize_t zero_progress_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	unsigned long total = __sbdd.zero_chunks;
+
+	if (READ_ONCE(__sbdd.zero_complete) || !total)
+		return sysfs_emit(buf, "100\n");
+
+	return sysfs_emit(buf, "%lu\n",
+			  atomic_long_read(&__sbdd.zeroed) * 100 / total);
+}
+static DEVICE_ATTR_RO(zero_progress);
+
+static ssize_t phys_state_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	if (__sbdd.store != SBDD_STORE_PHYS)
+		return sysfs_emit(buf, "none\n");
+
+	return sysfs_emit(buf, "%s\n", sbdd_phys_state_names[__sbdd.phys_state]);
+}
+static DEVICE_ATTR_RO(phys_state);
+
+/* Lists supported engines with the selected one in brackets */
+static ssize_t copy_engine_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	unsigned int engine = READ_ONCE(__sbdd.copy_engine);
+	ssize_t len = 0;
+	unsigned int i;
+
+	for (i = 0; i < SBDD_COPY_NR; i++) {
+		if (!sbdd_copy_engine_supported(i))
+			continue;
+		len += sysfs_emit_at(buf, len, i == engine ? "[%s] " : "%s ",
+				     sbdd_copy_engine_names[i]);
+	}
+	buf[len - 1] = '\n';
+
+	return len;
+}
+
+static ssize_t copy_engine_store(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	int engine = sysfs_match_string(sbdd_copy_engine_names, buf);
+
+	if (engine < 0)
+		return engine;
+	if (!sbdd_copy_engine_supported(engine))
+		return -EOPNOTSUPP;
+
+	WRITE_ONCE(__sbdd.copy_engine, engine);
+	return count;
+}
+static DEVICE_ATTR_RW(copy_engine);
+
+static ssize_t ioprio_policy_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	unsigned int policy = READ_ONCE(__sbdd.ioprio_policy);
+	ssize_t len = 0;
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(sbdd_ioprio_policy_names); i++)
+		len += sysfs_emit_at(buf, len, i == policy ? "[%s] " : "%s ",
+				     sbdd_ioprio_policy_names[i]);
+	buf[len - 1] = '\n';
+
+	return len;
+}
+
+static ssize_t ioprio_policy_store(struct device *dev,
+				   struct device_attribute *attr,
+				   const char *buf, size_t count)
+{
+	int policy = sysfs_match_string(sbdd_ioprio_policy_names, buf);
+
+	if (policy < 0)
+		return policy;
+
+	WRITE_ONCE(__sbdd.ioprio_policy, policy);
+	return count;
+}
+static DEVICE_ATTR_RW(ioprio_policy);
+
+/* A tunable in [_min, _max], anything else is rejected with -EINVAL */
+#define SBDD_UINT_ATTR(_name, _min, _max)				\
+static ssize_t _name##_show(struct device *dev,				\
+			    struct device_attribute *attr, char *buf)	\
+{									\
+	return sysfs_emit(buf, "%u\n", READ_ONCE(__sbdd._name));	\
+}									\
+									\
+static ssize_t _name##_store(struct device *dev,			\
+			     struct device_attribute *attr,		\
+			     const char *buf, size_t count)		\
+{									\
+	unsigned int val;						\
+	int ret = kstrtouint(buf, 0, &val);				\
+									\
+	if (ret)							\
+		return ret;						\
+	if (val < (_min) || val > (_max))				\
+		return -EINVAL;						\
+									\
+	WRITE_ONCE(__sbdd._name, val);					\
+	return count;							\
+}									\
+static DEVICE_ATTR_RW(_name)
+
+SBDD_UINT_ATTR(copy_nt_min_kb, 0, SBDD_TUNABLE_MAX_KB);
+SBDD_UINT_ATTR(copy_simd_min_kb, 0, SBDD_TUNABLE_MAX_KB);
+SBDD_UINT_ATTR(parallel_min_kb, 0, SBDD_TUNABLE_MAX_KB);
+SBDD_UINT_ATTR(parallel_chunk_kb, PAGE_SIZE >> 10, SBDD_MAX_HW_SECTORS >> 1);
+SBDD_UINT_ATTR(lock_hold_kb, 1, SBDD_TUNABLE_MAX_KB);
+SBDD_UINT_ATTR(resched_kb, 1, SBDD_TUNABLE_MAX_KB);
+SBDD_UINT_ATTR(page_swap, 0, 1);
+SBDD_UINT_ATTR(plug_batch, 0, 1);
+SBDD_UINT_ATTR(latency_us, 0, USEC_PER_SEC);
+SBDD_UINT_ATTR(prio_weight_rt, 0, SBDD_PRIO_WEIGHT_MAX);
+SBDD_UINT_ATTR(prio_weight_be, 0, SBDD_PRIO_WEIGHT_MAX);
+SBDD_UINT_ATTR(prio_weight_idle, 0, SBDD_PRIO_WEIGHT_MAX);
+
+static struct attribute *sbdd_attrs[] = {
+	&dev_attr_lock_acquired.attr,
+	&dev_attr_lock_contended.attr,
+	&dev_attr_page_swaps.attr,
+	&dev_attr_plug_batches.attr,
+	&dev_attr_plug_bios.attr,
+	&dev_attr_vio_calls.attr,
+	&dev_attr_vio_vecs.attr,
+	&dev_attr_range_copies.attr,
+	&dev_attr_cloned_pages.attr,
+	&dev_attr_shrink_scans.attr,
+	&dev_attr_shrink_cached.attr,
+	&dev_attr_shrink_zero.attr,
+	&dev_attr_nowait_again.attr,
+	&dev_attr_prio_rt.attr,
+	&dev_attr_prio_be.attr,
+	&dev_attr_prio_idle.attr,
+	&dev_attr_zero_progress.attr,
+	&dev_attr_phys_state.attr,
+	&dev_attr_copy_engine.attr,
+	&dev_attr_copy_nt_min_kb.attr,
+	&dev_attr_copy_simd_min_kb.attr,
+	&dev_attr_parallel_min_kb.attr,
+	&dev_attr_parallel_chunk_kb.attr,
+	&dev_attr_lock_hold_kb.attr,
+	&dev_attr_resched_kb.attr,
+	&dev_attr_page_swap.attr,
+	&dev_attr_plug_batch.attr,
+	&dev_attr_latency_us.attr,
+	&dev_attr_ioprio_policy.attr,
+	&dev_attr_prio_weight_rt.attr,
+	&dev_attr_prio_weight_be.attr,
+	&dev_attr_prio_weight_idle.attr,
+	NULL,
+};
+
+/* Shows up as /sys/block/sbdd/sbdd/ */
+static const struct attribute_group sbdd_attr_group = {
+	.name = SBDD_NAME,
+	.attrs = sbdd_attrs,
+};
+
+static const struct attribute_group *sbdd_attr_groups[] = {
+	&sbdd_attr_group,
+	NULL,
+};
+
+/* Shares the page of src with the slot of dst, both page aligned */
+static int sbdd_clone_page(size_t src, size_t dst)
+{
+	spinlock_t *slock = sbdd_datalock(src), *dlock = sbdd_datalock(dst);
+	struct page *page, *old;
+	int ret;
+
+	/* The slot is allocated up front, the store below must not sleep */
+	ret = xa_reserve(&__sbdd.pages, dst >> PAGE_SHIFT, GFP_KERNEL);
+	if (ret)
+		return ret;
+
+	sbdd_lock_pair(slock, dlock);
+	xa_lock(&__sbdd.pages);
+	page = xa_load(&__sbdd.pages, src >> PAGE_SHIFT);
+	if (page) {
+		set_page_private(page, page_private(page) + 1);
+		get_page(page);
+		old = __xa_store(&__sbdd.pages, dst >> PAGE_SHIFT, page,
+				 GFP_NOWAIT);
+		if (xa_is_err(old)) {
+			ret = xa_err(old);
+			old = page;
+		}
+	} else {
+		old = __xa_erase(&__sbdd.pages, dst >> PAGE_SHIFT);
+	}
+	if (old)
+		sbdd_page_release(old);
+	if (!ret && !old != !page)
+		atomic_long_add(page ? 1 : -1, &__sbdd.nr_pages);
+	xa_unlock(&__sbdd.pages);
+	sbdd_unlock_pair(slock, dlock);
+
+	if (!ret)
+		this_cpu_inc(__sbdd.stats->cloned_pages);
+	return ret;
+}
+
+/*
+Copies len bytes of the linear or sparse store with both stripes held, so
+the copy is a single memcpy. A sparse destination is populated and
+unshared first; both can be undone by a concurrent clone, hence the retry.
+*/
+static int sbdd_copy_piece(size_t src, size_t dst, size_t len)
+{
+	spinlock_t *slock = sbdd_datalock(src), *dlock = sbdd_datalock(dst);
+	void *saddr, *daddr;
+	int ret;
+
+retry:
+	if (__sbdd.store == SBDD_STORE_PAGES) {
+		ret = sbdd_pages_populate(dst, len, GFP_KERNEL);
+		if (!ret)
+			ret = sbdd_page_unshare(dst, GFP_KERNEL);
+		if (ret)
+			return ret;
+	}
+
+	sbdd_lock_pair(slock, dlock);
+	rcu_read_lock();
+
+	daddr = sbdd_store_addr(dst);
+	if (!daddr || (__sbdd.store == SBDD_STORE_PAGES &&
+		       sbdd_page_shared(dst))) {
+		rcu_read_unlock();
+		sbdd_unlock_pair(slock, dlock);
+		goto retry;
+	}
+
+	saddr = sbdd_store_addr(src);
+	if (saddr)
+		memcpy(daddr, saddr, len);
+	else
+		memset(daddr, 0, len);
+
+	rcu_read_unlock();
+	sbdd_unlock_pair(slock, dlock);
+	return 0;
+}
+
+/* The file backed stores copy page by page through a bounce page */
+static int sbdd_copy_range_file(size_t src, size_t dst, size_t len)
+{
+	struct sbdd_xfer_ctx ctx;
+	size_t piece;
+	void *buf;
+	int ret = 0;
+
+	buf = (void *)__get_free_page(GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	sbdd_ctx_init(&ctx, 0, SBDD_COPY_MEMCPY, true);
+	for (; len; len -= piece, src += piece, dst += piece) {
+		piece = min3(len, PAGE_SIZE - offset_in_page(src),
+			     PAGE_SIZE - offset_in_page(dst));
+
+		ctx.dir = 0;
+		ret = sbdd_shmem_xfer(buf, src, piece, &ctx);
+		if (ret)
+			break;
+		ctx.dir = 1;
+		ret = sbdd_shmem_xfer(buf, dst, piece, &ctx);
+		if (ret)
+			break;
+
+		if (fatal_signal_pending(current)) {
+			ret = -EINTR;
+			break;
+		}
+		cond_resched();
+	}
+
+	free_page((unsigned long)buf);
+	return ret;
+}
+
+static int sbdd_copy_range(size_t src, size_t dst, size_t len, bool clone)
+{
+	size_t hold = (size_t)READ_ONCE(__sbdd.lock_hold_kb) << 10;
+	struct sbdd_xfer_ctx ctx;
+	size_t piece;
+	int ret;
+
+	if (sbdd_store_file())
+		return sbdd_copy_range_file(src, dst, len);
+
+	/* Sharing a page mapped through /dev/sbdd-mem would leak stores */
+	clone = clone && __sbdd.store == SBDD_STORE_PAGES &&
+		!atomic_read(&__sbdd.mem_maps);
+
+	sbdd_ctx_init(&ctx, 1, SBDD_COPY_MEMCPY, true);
+	ret = sbdd_zero_range(&ctx, src, len);
+	if (!ret)
+		ret = sbdd_zero_range(&ctx, dst, len);
+	if (ret)
+		return ret;
+
+	for (; len; len -= piece, src += piece, dst += piece) {
+		piece = min3(len, sbdd_store_span(src), sbdd_store_span(dst));
+		piece = min(piece, hold);
+
+		if (clone && piece == PAGE_SIZE && !offset_in_page(src) &&
+		    !offset_in_page(dst))
+			ret = sbdd_clone_page(src, dst);
+		else
+			ret = sbdd_copy_piece(src, dst, piece);
+		if (ret)
+			return ret;
+
+		if (fatal_signal_pending(current))
+			return -EINTR;
+		cond_resched();
+	}
+
+	return 0;
+}
+
+static int sbdd_ioctl_copy_range(struct block_device *bdev, blk_mode_t mode,
+				 struct sbdd_range __user *urange)
+{
+	struct address_space *mapping = bdev->bd_mapping;
+	sector_t nr = bdev_nr_sectors(bdev);
+	struct sbdd_range r;
+	loff_t src, dst, len;
+	struct file *file;
+	int ret;
+
+	if (copy_from_user(&r, urange, sizeof(r)))
+		return -EFAULT;
+	if (!(mode & BLK_OPEN_WRITE))
+		return -EBADF;
+	if (bdev_read_only(bdev))
+		return -EROFS;
+	if (r.flags & ~SBDD_RANGE_NOCLONE)
+		return -EINVAL;
+
+	/* The module drives a single disk, other devices cannot share its store */
+	if (r.dst_fd >= 0) {
+		file = fget(r.dst_fd);
+		if (!file)
+			return -EBADF;
+		ret = 0;
+		if (!S_ISBLK(file_inode(file)->i_mode))
+			ret = -EINVAL;
+		else if (I_BDEV(file->f_mapping->host)->bd_disk != bdev->bd_disk)
+			ret = -EXDEV;
+		else if (I_BDEV(file->f_mapping->host) != bdev)
+			ret = -EINVAL;
+		fput(file);
+		if (ret)
+			return ret;
+	}
+
+	if (!r.nr_sectors || r.src_sector >= nr || r.nr_sectors > nr - r.src_sector ||
+	    r.dst_sector >= nr || r.nr_sectors > nr - r.dst_sector)
+		return -EINVAL;
+
+	src = (loff_t)r.src_sector << SBDD_SECTOR_SHIFT;
+	dst = (loff_t)r.dst_sector << SBDD_SECTOR_SHIFT;
+	len = (loff_t)r.nr_sectors << SBDD_SECTOR_SHIFT;
+	if (src < dst + len && dst < src + len)
+		return -EINVAL;
+
+	if (atomic_read(&__sbdd.deleting) ||
+	    !atomic_inc_not_zero(&__sbdd.refs_cnt))
+		return -ENODEV;
+
+	/* Same page cache handling as BLKDISCARD */
+	filemap_invalidate_lock(mapping);
+	ret = filemap_write_and_wait_range(mapping, src, src + len - 1);
+	if (!ret)
+		ret = filemap_write_and_wait_range(mapping, dst, dst + len - 1);
+	if (!ret)
+		ret = sbdd_copy_range(src + (bdev->bd_start_sect << SBDD_SECTOR_SHIFT),
+				      dst + (bdev->bd_start_sect << SBDD_SECTOR_SHIFT),
+				      len, !(r.flags & SBDD_RANGE_NOCLONE));
+	invalidate_inode_pages2_range(mapping, dst >> PAGE_SHIFT,
+				      (dst + len - 1) >> PAGE_SHIFT);
+	filemap_invalidate_unlock(mapping);
+
+	if (!ret)
+		this_cpu_inc(__sbdd.stats->range_copies);
+	sbdd_put();
+	return ret;
+}
+
+static int sbdd_ioctl(struct block_device *bdev, blk_mode_t mode,
+		      unsigned int cmd, unsigned long arg)
+{
+	switch (cmd) {
+	case SBDD_IOC_COPY_RANGE:
+		return sbdd_ioctl_copy_range(bdev, mode, (void __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
+/*
+There are no read or write operations. These operations are performed by
+the request() function associated with the request queue of the disk.
+*/
+static struct block_device_operations const __sbdd_bdev_ops = {
+	.owner = THIS_MODULE,
+	.submit_bio = sbdd_submit_bio,
+	.ioctl = sbdd_ioctl,
+	.compat_ioctl = blkdev_compat_ptr_ioctl,
+};
+
+static struct block_device_operations const __sbdd_mq_bdev_ops = {
+	.owner = THIS_MODULE,
+	.ioctl = sbdd_ioctl,
+	.compat_ioctl = blkdev_compat_ptr_ioctl,
+};
+
+static int sbdd_add_disk(void);
+static void sbdd_remove_disk(void);
+
+/* User pages spanned by the buffer of a tuple */
+static unsigned int sbdd_vec_pages(const struct sbdd_vec *vec)
+{
+	return DIV_ROUND_UP(offset_in_page(vec->buf) +
+			    ((size_t)vec->nr_sectors << SBDD_SECTOR_SHIFT),
+			    PAGE_SIZE);
+}
+
+/* Copies one pinned tuple, may leave ctx->lock held for the next one */
+static int sbdd_vio_xfer(struct sbdd_xfer_ctx *ctx, const struct sbdd_vec *vec,
+			 struct page **pages)
+{
+	size_t offset = vec->sector << SBDD_SECTOR_SHIFT;
+	size_t len = (size_t)vec->nr_sectors << SBDD_SECTOR_SHIFT;
+	unsigned int poff = offset_in_page(vec->buf);
+	sector_t pos = vec->sector;
+	struct bio_vec bvec;
+	int ret;
+
+	ret = sbdd_zero_range(ctx, offset, len);
+	if (ret)
+		return ret;
+
+	if (ctx->dir && __sbdd.store == SBDD_STORE_PAGES) {
+		sbdd_ctx_unlock(ctx);
+		ret = sbdd_pages_populate(offset, len, ctx->gfp);
+		if (ret)
+			return ret;
+	}
+
+	for (; len; pages++, poff = 0) {
+		bvec_set_page(&bvec, *pages, min_t(size_t, len, PAGE_SIZE - poff),
+			      poff);
+		pos += sbdd_xfer(&bvec, pos, ctx);
+		if (ctx->err)
+			return ctx->err;
+		len -= bvec.bv_len;
+	}
+
+	return 0;
+}
+
+/*
+Same page cache handling as an O_DIRECT write to the whole disk: dirty
+pages over the tuples are written back before the copy and the cached
+ones are dropped after it. Without blocking, any page cached over the
+tuples fails the write with -EAGAIN instead, like IOCB_NOWAIT direct I/O.
+*/
+static int sbdd_vio_sync_cache(const struct sbdd_vec *vecs, unsigned int nr,
+			       bool after, bool nowait)
+{
+	struct address_space *mapping = __sbdd.gd->part0->bd_mapping;
+	loff_t start, end;
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < nr; i++) {
+		start = (loff_t)vecs[i].sector << SBDD_SECTOR_SHIFT;
+		end = start + ((loff_t)vecs[i].nr_sectors << SBDD_SECTOR_SHIFT) - 1;
+		if (nowait) {
+			if (filemap_range_has_page(mapping, start, end))
+				return -EAGAIN;
+			continue;
+		}
+		if (after) {
+			invalidate_inode_pages2_range(mapping, start >> PAGE_SHIFT,
+						      end >> PAGE_SHIFT);
+			continue;
+		}
+		ret = filemap_write_and_wait_range(mapping, start, end);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/* Without blocking the vector is only copied if it is resident */
+static struct sbdd_vec *sbdd_vio_vecs(const struct sbdd_vio *vio, bool nowait)
+{
+	struct sbdd_vec *vecs;
+	unsigned long left;
+
+	if (!nowait)
+		return memdup_array_user(u64_to_user_ptr(vio->vecs),
+					 vio->nr_vecs, sizeof(*vecs));
+
+	vecs = kmalloc_array(vio->nr_vecs, sizeof(*vecs),
+			     GFP_NOWAIT | __GFP_NOWARN);
+	if (!vecs)
+		return ERR_PTR(-EAGAIN);
+
+	pagefault_disable();
+	left = copy_from_user(vecs, u64_to_user_ptr(vio->vecs),
+			      vio->nr_vecs * sizeof(*vecs));
+	pagefault_enable();
+	if (left) {
+		kfree(vecs);
+		return ERR_PTR(-EAGAIN);
+	}
+
+	return vecs;
+}
+
+/*
+Serves a whole vector with one transfer context: consecutive tuples in the
+same stripe share a lock acquisition and the caller gets one completion.
+User buffers are pinned up front since nothing may fault under the data
+locks.
+
+With nowait, as issued inline by io_uring, nothing faults, allocates with
+reclaim, writes back page cache or waits for the store; whatever would
+fails the call with -EAGAIN and io_uring reissues it from io-wq. Tuples
+copied before that are copied again then, with the same buffers.
+*/
+static long sbdd_vio(const struct sbdd_vio *vio, bool nowait)
+{
+	unsigned int gup = vio->flags & SBDD_VIO_WRITE ? 0 : FOLL_WRITE;
+	int dir = vio->flags & SBDD_VIO_WRITE ? WRITE : READ;
+	struct sbdd_vec *vecs;
+	struct page **pages = NULL;
+	struct sbdd_xfer_ctx ctx;
+	unsigned int nr_pages = 0, pinned = 0, idx, i;
+	u64 bytes = 0;
+	long ret;
+
+	if (vio->flags & ~SBDD_VIO_WRITE)
+		return -EINVAL;
+	if (!vio->nr_vecs || vio->nr_vecs > SBDD_VIO_MAX_VECS)
+		return -EINVAL;
+
+	/*
+	Same protection against teardown as a bio, it also keeps gd around.
+	Fails as well while no memfd is attached yet.
+	*/
+	if (atomic_read(&__sbdd.deleting) ||
+	    !atomic_inc_not_zero(&__sbdd.refs_cnt))
+		return -ENODEV;
+
+	if (dir == WRITE && get_disk_ro(__sbdd.gd)) {
+		sbdd_put();
+		return -EROFS;
+	}
+
+	vecs = sbdd_vio_vecs(vio, nowait);
+	if (IS_ERR(vecs)) {
+		ret = PTR_ERR(vecs);
+		vecs = NULL;
+		goto out_free;
+	}
+
+	for (i = 0; i < vio->nr_vecs; i++) {
+		struct sbdd_vec *v = &vecs[i];
+
+		ret = -EINVAL;
+		if (!v->nr_sectors || v->buf & (SBDD_SECTOR_SIZE - 1) ||
+		    v->sector >= __sbdd.capacity ||
+		    v->nr_sectors > __sbdd.capacity - v->sector)
+			goto out_free;
+		bytes += (u64)v->nr_sectors << SBDD_SECTOR_SHIFT;
+		nr_pages += sbdd_vec_pages(v);
+	}
+
+	ret = -EINVAL;
+	if (bytes > (u64)SBDD_MAX_HW_SECTORS << SBDD_SECTOR_SHIFT)
+		goto out_free;
+
+	ret = -ENOMEM;
+	pages = kvmalloc_array(nr_pages, sizeof(*pages),
+			       nowait ? GFP_NOWAIT | __GFP_NOWARN : GFP_KERNEL);
+	if (!pages)
+		goto out_free;
+
+	if (nowait)
+		gup |= FOLL_NOFAULT;
+
+	for (i = 0; i < vio->nr_vecs; i++) {
+		unsigned long addr = vecs[i].buf & PAGE_MASK;
+		unsigned int n = sbdd_vec_pages(&vecs[i]);
+
+		ret = pin_user_pages_fast(addr, n, gup, pages + pinned);
+		if (ret > 0)
+			pinned += ret;
+		if (ret != n) {
+			ret = ret < 0 ? ret : -EFAULT;
+			goto out_unpin;
+		}
+	}
+
+	if (dir == WRITE) {
+		ret = sbdd_vio_sync_cache(vecs, vio->nr_vecs, false, nowait);
+		if (ret)
+			goto out_unpin;
+	}
+
+	sbdd_ctx_init(&ctx, dir, SBDD_COPY_MEMCPY, !nowait);
+	ctx.page_swap = false;
+	for (i = 0, idx = 0; i < vio->nr_vecs; i++) {
+		ret = sbdd_vio_xfer(&ctx, &vecs[i], pages + idx);
+		if (ret)
+			break;
+		idx += sbdd_vec_pages(&vecs[i]);
+
+		if (ctx.can_resched &&
+		    ctx.since_resched >= ctx.resched_max) {
+			sbdd_ctx_unlock(&ctx);
+			cond_resched();
+			ctx.since_resched = 0;
+		}
+	}
+	sbdd_ctx_unlock(&ctx);
+
+	if (dir == WRITE && !nowait)
+		sbdd_vio_sync_cache(vecs, vio->nr_vecs, true, false);
+
+	if (!ret) {
+		this_cpu_inc(__sbdd.stats->vio_calls);
+		this_cpu_add(__sbdd.stats->vio_vecs, vio->nr_vecs);
+		ret = bytes;
+	}
+
+out_unpin:
+	unpin_user_pages_dirty_lock(pages, pinned, dir == READ);
+out_free:
+	kvfree(pages);
+	kfree(vecs);
+	sbdd_put();
+
+	/* A fault or a failed allocation may well succeed from io-wq */
+	if (nowait && (ret == -EAGAIN || ret == -ENOMEM || ret == -EFAULT)) {
+		this_cpu_inc(__sbdd.stats->nowait_again);
+		ret = -EAGAIN;
+	}
+
+	return ret;
+}
+
+static int sbdd_ctl_uring_cmd(struct io_uring_cmd *cmd, unsigned int issue_flags)
+{
+	const struct sbdd_vio *vio = io_uring_sqe_cmd(cmd->sqe);
+	struct sbdd_vio v;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	switch (cmd->cmd_op) {
+	case SBDD_IOC_VIO:
+		/* The SQE is shared with user space, read it once */
+		v.vecs = READ_ONCE(vio->vecs);
+		v.nr_vecs = READ_ONCE(vio->nr_vecs);
+		v.flags = READ_ONCE(vio->flags);
+
+		/* -EAGAIN inline has io_uring retry from io-wq, which may block */
+		return sbdd_vio(&v, issue_flags & IO_URING_F_NONBLOCK);
+	default:
+		return -ENOTTY;
+	}
+}
+
+static int sbdd_attach_memfd(struct sbdd_attach __user *uattach)
+{
+	struct sbdd_attach attach;
+	struct inode *inode;
+	struct file *file;
+	sector_t capacity;
+	unsigned int seals;
+	int ret;
+
+	if (copy_from_user(&attach, uattach, sizeof(attach)))
+		return -EFAULT;
+	if (attach.flags)
+		return -EINVAL;
+	if (__sbdd.store != SBDD_STORE_MEMFD)
+		return -EOPNOTSUPP;
+
+	file = fget(attach.memfd);
+	if (!file)
+		return -EBADF;
+
+	/* hugetlbfs memfds are not shmem files */
+	ret = -EINVAL;
+	if (!shmem_file(file))
+		goto out_put;
+
+	/*
+	A shrinking memfd would turn into I/O errors past its new end. Seals
+	are only read here, so a writable disk needs F_SEAL_SEAL too or a write
+	seal added later would not stop the disk from changing the contents.
+	Write seals cannot be removed, the disk then stays read only anyway.
+	*/
+	inode = file_inode(file);
+	seals = SHMEM_I(inode)->seals;
+	if (!(seals & F_SEAL_SHRINK))
+		goto out_put;
+	if (!(seals & (F_SEAL_SEAL | F_SEAL_WRITE | F_SEAL_FUTURE_WRITE)))
+		goto out_put;
+
+	capacity = i_size_read(inode) >> SBDD_SECTOR_SHIFT;
+	if (!capacity)
+		goto out_put;
+
+	mutex_lock(&__sbdd.ctl_lock);
+	ret = -ENODEV;
+	if (atomic_read(&__sbdd.deleting))
+		goto out_unlock;
+	ret = -EBUSY;
+	if (__sbdd.shmem)
+		goto out_unlock;
+
+	__sbdd.shmem = file;
+	__sbdd.capacity = capacity;
+	__sbdd.read_only = seals & (F_SEAL_WRITE | F_SEAL_FUTURE_WRITE);
+	ret = sbdd_add_disk();
+	if (ret) {
+		__sbdd.shmem = NULL;
+		goto out_unlock;
+	}
+	mutex_unlock(&__sbdd.ctl_lock);
+
+	pr_info("attached memfd of %llu sectors\n", capacity);
+	attach.size = (u64)capacity << SBDD_SECTOR_SHIFT;
+	return copy_to_user(uattach, &attach, sizeof(attach)) ? -EFAULT : 0;
+
+out_unlock:
+	mutex_unlock(&__sbdd.ctl_lock);
+out_put:
+	fput(file);
+	return ret;
+}
+
+static long sbdd_ctl_ioctl(struct file *file, unsigned int cmd,
+			   unsigned long arg)
+{
+	void __user *argp = (void __user *)arg;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	switch (cmd) {
+	case SBDD_IOC_ATTACH_MEMFD:
+		return sbdd_attach_memfd(argp);
+	case SBDD_IOC_VIO: {
+		struct sbdd_vio vio;
+
+		if (copy_from_user(&vio, argp, sizeof(vio)))
+			return -EFAULT;
+		return sbdd_vio(&vio, false);
+	}
+	case SBDD_IOC_DELETE:
+		mutex_lock(&__sbdd.ctl_lock);
+		if (!__sbdd.gd) {
+			mutex_unlock(&__sbdd.ctl_lock);
+			return -ENODEV;
+		}
+		sbdd_remove_disk();
+		mutex_unlock(&__sbdd.ctl_lock);
+		return 0;
+	default:
+		return -ENOTTY;
+	}
+}
+
+static const struct file_operations __sbdd_ctl_fops = {
+	.owner = THIS_MODULE,
+	.unlocked_ioctl = sbdd_ctl_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
+	.uring_cmd = sbdd_ctl_uring_cmd,
+};
+
+/* Shows up as /dev/sbdd-ctl, see sbdd.h */
+static struct miscdevice __sbdd_ctl = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = SBDD_CTL_NAME,
+	.fops = &__sbdd_ctl_fops,
+};
+
+/*
+/dev/sbdd-mem maps the store itself, a scan through it costs no copy. The
+mapping shares pages with block I/O but is not ordered against it: data of
+a write is in the mapping once the write completed, a page written while
+it is being read through the mapping may show a mix of old and new bytes,
+and stores through the mapping are seen by the next block read that hits
+the driver (not by the block device page cache). vmalloc and pages stores
+are mapped page by page on fault, the file backed stores hand the mapping
+over to shmem.
+*/
+static vm_fault_t sbdd_mem_fault(struct vm_fault *vmf)
+{
+	size_t offset = (size_t)vmf->pgoff << PAGE_SHIFT;
+	struct page *page;
+
+	if (offset >= (size_t)__sbdd.capacity << SBDD_SECTOR_SHIFT)
+		return VM_FAULT_SIGBUS;
+
+	if (__sbdd.store == SBDD_STORE_PAGES) {
+		/* Stores through the mapping must not reach a cloned page */
+		do {
+			if (sbdd_pages_populate(offset, PAGE_SIZE, GFP_KERNEL) ||
+			    sbdd_page_unshare(offset, GFP_KERNEL))
+				return VM_FAULT_OOM;
+			rcu_read_lock();
+			page = xa_load(&__sbdd.pages, vmf->pgoff);
+			if (page && !get_page_unless_zero(page))
+				page = NULL;
+			/* The shrinker may have dropped it before our reference */
+			if (page && xa_load(&__sbdd.pages, vmf->pgoff) != page) {
+				put_page(page);
+				page = NULL;
+			}
+			rcu_read_unlock();
+		} while (!page);
+	} else {
+		/* Garbage of a lazily zeroed store must never reach user space */
+		if (!READ_ONCE(__sbdd.zero_complete))
+			sbdd_zero_chunk(offset >> SBDD_ZERO_CHUNK_SHIFT, true);
+		page = vmalloc_to_page(sbdd_store_addr(offset));
+		get_page(page);
+	}
 
-struct sbdd {
-	wait_queue_head_t       exitwait;
-	spinlock_t              datalock;
-	atomic_t                deleting;
-	atomic_t                refs_cnt;
-	sector_t                capacity;
-	u8                      *data;
-	struct gendisk          *gd;
+	vmf->page = page;
+	return 0;
+}
+
+static void sbdd_mem_vm_open(struct vm_area_struct *vma)
+{
+	atomic_inc(&__sbdd.mem_maps);
+}
+
+static void sbdd_mem_vm_close(struct vm_area_struct *vma)
+{
+	atomic_dec(&__sbdd.mem_maps);
+}
+
+static const struct vm_operations_struct __sbdd_mem_vm_ops = {
+	.open = sbdd_mem_vm_open,
+	.close = sbdd_mem_vm_close,
+	.fault = sbdd_mem_fault,
 };
 
-static struct sbdd              __sbdd = { 0 };
-static unsigned long            __sbdd_capacity_mib = 100;
+/* Mapped up front by remap_pfn_range(), only counted for the reboot check */
+static const struct vm_operations_struct __sbdd_phys_vm_ops = {
+	.open = sbdd_mem_vm_open,
+	.close = sbdd_mem_vm_close,
+};
 
-static sector_t sbdd_xfer(struct bio_vec* bvec, sector_t pos, int dir)
+static int sbdd_mem_mmap(struct file *file, struct vm_area_struct *vma)
 {
-	void *buff = kmap_atomic(bvec->bv_page) + bvec->bv_offset;
-	sector_t len = bvec->bv_len >> SBDD_SECTOR_SHIFT;
-	size_t offset;
-	size_t nbytes;
+	struct file *shmem = READ_ONCE(__sbdd.shmem);
+	unsigned long pages;
+	int ret;
 
-	if (pos + len > __sbdd.capacity)
-		len = __sbdd.capacity - pos;
+	if (sbdd_store_file()) {
+		/* No memfd attached yet */
+		if (!shmem)
+			return -ENODEV;
+		vma_set_file(vma, shmem);
+		return call_mmap(shmem, vma);
+	}
 
-	offset = pos << SBDD_SECTOR_SHIFT;
-	nbytes = len << SBDD_SECTOR_SHIFT;
+	pages = __sbdd.capacity >> (PAGE_SHIFT - SBDD_SECTOR_SHIFT);
+	if (vma->vm_pgoff > pages || vma_pages(vma) > pages - vma->vm_pgoff)
+		return -EINVAL;
 
-	spin_lock(&__sbdd.datalock);
+	/* The phys region has no struct pages of its own to fault in */
+	if (__sbdd.store == SBDD_STORE_PHYS) {
+		ret = remap_pfn_range(vma, vma->vm_start,
+				      PHYS_PFN(__sbdd_phys_addr + PAGE_SIZE) +
+				      vma->vm_pgoff,
+				      vma->vm_end - vma->vm_start,
+				      vma->vm_page_prot);
+		if (ret)
+			return ret;
 
-	if (dir)
-		memcpy(__sbdd.data + offset, buff, nbytes);
-	else
-		memcpy(buff, __sbdd.data + offset, nbytes);
+		vma->vm_ops = &__sbdd_phys_vm_ops;
+		sbdd_mem_vm_open(vma);
+		return 0;
+	}
+
+	vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+	vma->vm_ops = &__sbdd_mem_vm_ops;
+	sbdd_mem_vm_open(vma);
+	return 0;
+}
+
+static const struct file_operations __sbdd_mem_fops = {
+	.owner = THIS_MODULE,
+	.mmap = sbdd_mem_mmap,
+};
 
-	spin_unlock(&__sbdd.datalock);
+/* Shows up as /dev/sbdd-mem */
+static struct miscdevice __sbdd_mem = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = SBDD_MEM_NAME,
+	.fops = &__sbdd_mem_fops,
+};
 
-	pr_debug("pos=%6llu len=%4llu %s\n", pos, len, dir ? "written" : "read");
+/* Part of the seed image written into the store by a copy_wq worker */
+struct sbdd_seed_work {
+	struct work_struct      work;
+	const u8                *src;
+	size_t                  offset;
+	size_t                  len;
+	int                     err;
+};
 
-	kunmap_atomic(buff);
-	return len;
+/*
+Writes len bytes of the image at offset of the store. The disk does not
+exist yet, so nothing else touches the store and no data lock is taken.
+Zero pages of the sparse store are left as holes.
+*/
+static int sbdd_seed_write(const u8 *src, size_t offset, size_t len)
+{
+	struct sbdd_xfer_ctx ctx;
+	size_t piece;
+	int ret = 0;
+
+	sbdd_ctx_init(&ctx, 1, sbdd_copy_engine(len, 1), true);
+	ret = sbdd_zero_range(&ctx, offset, len);
+	if (ret)
+		return ret;
+
+	for (; len; len -= piece, src += piece, offset += piece) {
+		piece = min(len, sbdd_store_span(offset));
+
+		if (sbdd_store_file()) {
+			ret = sbdd_shmem_xfer((void *)src, offset, piece, &ctx);
+		} else if (__sbdd.store == SBDD_STORE_PAGES) {
+			if (!memchr_inv(src, 0, piece))
+				continue;
+			ret = sbdd_pages_populate(offset, piece, GFP_KERNEL);
+			if (!ret)
+				memcpy(sbdd_store_addr(offset), src, piece);
+		} else {
+			sbdd_copy(sbdd_store_addr(offset), src, piece, ctx.engine);
+		}
+		if (ret)
+			return ret;
+
+		cond_resched();
+	}
+
+	return 0;
 }
 
-static void sbdd_submit_bio(struct bio *bio)
+static void sbdd_seed_work_fn(struct work_struct *work)
 {
-	struct bvec_iter iter;
-	struct bio_vec bvec;
-	int dir;
-	sector_t pos;
+	struct sbdd_seed_work *sw = container_of(work, struct sbdd_seed_work,
+						 work);
 
-	bio = bio_split_to_limits(bio);
-	if (!bio)
-		return;
+	sw->err = sbdd_seed_write(sw->src, sw->offset, sw->len);
+}
 
-	if (atomic_read(&__sbdd.deleting)) {
-		bio_io_error(bio);
-		return;
+/* Splits the copy into page aligned chunks, at least four per cpu */
+static int sbdd_seed_parallel(const u8 *src, size_t offset, size_t len)
+{
+	size_t chunk = (size_t)__sbdd.parallel_chunk_kb << 10;
+	struct sbdd_seed_work *works;
+	unsigned long nr, i;
+	int ret = 0;
+
+	chunk = round_up(max_t(size_t, chunk, len / (num_online_cpus() * 4)),
+			 PAGE_SIZE);
+	nr = DIV_ROUND_UP(len, chunk);
+	if (nr == 1)
+		return sbdd_seed_write(src, offset, len);
+
+	works = kvcalloc(nr, sizeof(*works), GFP_KERNEL);
+	if (!works)
+		return -ENOMEM;
+
+	for (i = 0; i < nr; i++) {
+		works[i].src = src + i * chunk;
+		works[i].offset = offset + i * chunk;
+		works[i].len = min(chunk, len - i * chunk);
+		INIT_WORK(&works[i].work, sbdd_seed_work_fn);
+		queue_work(__sbdd.copy_wq, &works[i].work);
 	}
 
-	if (!atomic_inc_not_zero(&__sbdd.refs_cnt)) {
-		bio_io_error(bio);
-		return;
+	for (i = 0; i < nr; i++) {
+		flush_work(&works[i].work);
+		if (!ret)
+			ret = works[i].err;
 	}
 
-	dir = bio_data_dir(bio);
-	pos = bio->bi_iter.bi_sector;
-	bio_for_each_segment(bvec, bio, iter)
-		pos += sbdd_xfer(&bvec, pos, dir);
+	kvfree(works);
+	return ret;
+}
 
-	bio_endio(bio);
+#if IS_ENABLED(CONFIG_ZSTD_DECOMPRESS)
+/*
+The decompression stream is sized once for the largest window of all
+frames of the image, up to SBDD_SEED_ZSTD_WINDOW (what zstd accepts by
+default).
+*/
+static int sbdd_seed_zstd_window(const u8 *data, size_t size, size_t *window)
+{
+	zstd_frame_header hdr;
+	size_t off = 0, len;
 
-	if (atomic_dec_and_test(&__sbdd.refs_cnt))
-		wake_up(&__sbdd.exitwait);
+	*window = 0;
+	while (off < size) {
+		if (zstd_get_frame_header(&hdr, data + off, size - off))
+			return -EINVAL;
+		if (hdr.windowSize > SBDD_SEED_ZSTD_WINDOW) {
+			pr_err("zstd: window of %llu bytes too large\n",
+			       hdr.windowSize);
+			return -E2BIG;
+		}
+		*window = max_t(size_t, *window, hdr.windowSize);
+
+		len = zstd_find_frame_compressed_size(data + off, size - off);
+		if (zstd_is_error(len))
+			return -EINVAL;
+		off += len;
+	}
+
+	return 0;
 }
 
 /*
-There are no read or write operations. These operations are performed by
-the request() function associated with the request queue of the disk.
+Decompression itself is sequential. Each SBDD_SEED_ZSTD_BUF of output is
+written in parallel while the next one waits, which still leaves the
+decompressor as the bottleneck. Concatenated frames are accepted. The
+stream is drained until it reports a finished frame with all input used,
+since output may still be buffered after the last input byte was read; an
+image ending in the middle of a frame is rejected.
 */
-static struct block_device_operations const __sbdd_bdev_ops = {
-	.owner = THIS_MODULE,
-	.submit_bio = sbdd_submit_bio,
-};
+static int sbdd_seed_zstd(const u8 *data, size_t size, size_t *written)
+{
+	size_t cap = (size_t)__sbdd.capacity << SBDD_SECTOR_SHIFT;
+	zstd_in_buffer in = { .src = data, .size = size };
+	size_t wksp_size, window, ret;
+	zstd_out_buffer out;
+	zstd_dstream *ds;
+	void *wksp, *buf;
+	int err = 0;
+
+	*written = 0;
+	err = sbdd_seed_zstd_window(data, size, &window);
+	if (err)
+		return err;
+
+	wksp_size = zstd_dstream_workspace_bound(window);
+	wksp = kvmalloc(wksp_size, GFP_KERNEL);
+	buf = kvmalloc(SBDD_SEED_ZSTD_BUF, GFP_KERNEL);
+	if (!wksp || !buf) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	ds = zstd_init_dstream(window, wksp, wksp_size);
+	if (!ds) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	do {
+		out = (zstd_out_buffer) {
+			.dst = buf,
+			.size = min_t(size_t, SBDD_SEED_ZSTD_BUF, cap - *written),
+		};
+		ret = zstd_decompress_stream(ds, &out, &in);
+		if (zstd_is_error(ret)) {
+			pr_err("zstd: %s\n", zstd_get_error_name(ret));
+			err = -EINVAL;
+			break;
+		}
+
+		err = sbdd_seed_parallel(buf, *written, out.pos);
+		if (err)
+			break;
+		*written += out.pos;
+
+		/* Room left in out, so the frame only waits for more input */
+		if (ret && in.pos == in.size && out.pos < out.size) {
+			pr_err("zstd: image truncated in the middle of a frame\n");
+			err = -EINVAL;
+			break;
+		}
+	} while ((ret || in.pos < in.size) && *written < cap);
+
+	if (!err && (ret || in.pos < in.size))
+		pr_warn("image larger than the disk, truncated\n");
+out:
+	kvfree(buf);
+	kvfree(wksp);
+	return err;
+}
+#else
+static int sbdd_seed_zstd(const u8 *data, size_t size, size_t *written)
+{
+	pr_err("zstd images need CONFIG_ZSTD_DECOMPRESS\n");
+	return -EOPNOTSUPP;
+}
+#endif
+
+/*
+Fills the store from the image firmware blob before the disk is added, so
+the disk shows up populated without a block layer write pass. The firmware
+loader looks in /lib/firmware (or firmware_class.path) of the root file
+system, the initramfs one when loaded from there. A blob starting with the
+zstd magic is decompressed on the fly.
+*/
+static int sbdd_seed(void)
+{
+	size_t cap = (size_t)__sbdd.capacity << SBDD_SECTOR_SHIFT;
+	ktime_t start = ktime_get();
+	const struct firmware *fw;
+	size_t written;
+	int ret;
+
+	/* Adopted contents of a previous kernel win over the image */
+	if (__sbdd.store == SBDD_STORE_PHYS &&
+	    __sbdd.phys_state != SBDD_PHYS_FORMATTED) {
+		pr_info("phys region adopted, not seeding\n");
+		return 0;
+	}
+
+	ret = request_firmware(&fw, __sbdd_image, __sbdd_ctl.this_device);
+	if (ret)
+		return ret;
+
+	if (fw->size >= 4 && get_unaligned_le32(fw->data) == ZSTD_MAGICNUMBER) {
+		ret = sbdd_seed_zstd(fw->data, fw->size, &written);
+	} else {
+		written = min(fw->size, cap);
+		if (fw->size > cap)
+			pr_warn("image larger than the disk, truncated\n");
+		ret = sbdd_seed_parallel(fw->data, 0, written);
+	}
+	release_firmware(fw);
+
+	if (!ret)
+		pr_info("seeded %zu bytes from %s in %lld ms\n", written,
+			__sbdd_image, ktime_ms_delta(ktime_get(), start));
+	return ret;
+}
+
+static struct gendisk *sbdd_alloc_mq_disk(struct queue_limits *limits)
+{
+	struct blk_mq_tag_set *set = &__sbdd.tag_set;
+	struct gendisk *gd;
+	int ret;
+
+	if (!__sbdd_hw_queues)
+		__sbdd_hw_queues = num_online_cpus();
+
+	set->ops = &__sbdd_mq_ops;
+	set->nr_hw_queues = __sbdd_hw_queues + __sbdd_poll_queues;
+	set->nr_maps = __sbdd_poll_queues ? HCTX_MAX_TYPES : 1;
+	set->queue_depth = __sbdd_queue_depth;
+	set->numa_node = NUMA_NO_NODE;
+	set->cmd_size = sizeof(struct sbdd_cmd);
+	set->flags = BLK_MQ_F_SHOULD_MERGE;
+	if (sbdd_store_file())
+		set->flags |= BLK_MQ_F_BLOCKING;
+	set->driver_data = &__sbdd;
+
+	ret = blk_mq_alloc_tag_set(set);
+	if (ret) {
+		set->ops = NULL;
+		return ERR_PTR(ret);
+	}
+
+	gd = blk_mq_alloc_disk(set, limits, &__sbdd);
+	if (IS_ERR(gd)) {
+		blk_mq_free_tag_set(set);
+		set->ops = NULL;
+	}
+
+	return gd;
+}
 
 static int sbdd_create(void)
 {
-	struct queue_limits limits = { 0 };
 	int ret = 0;
+	int i;
+
+	ret = match_string(sbdd_store_names, ARRAY_SIZE(sbdd_store_names),
+			   __sbdd_store);
+	if (ret < 0) {
+		pr_err("unknown store %s\n", __sbdd_store);
+		return ret;
+	}
+	__sbdd.store = ret;
+	xa_init(&__sbdd.pages);
+	spin_lock_init(&__sbdd.page_cache_lock);
+	INIT_LIST_HEAD(&__sbdd.page_cache);
+
+	ret = match_string(sbdd_queue_mode_names,
+			   ARRAY_SIZE(sbdd_queue_mode_names), __sbdd_queue_mode);
+	if (ret < 0) {
+		pr_err("unknown queue mode %s\n", __sbdd_queue_mode);
+		return ret;
+	}
+	__sbdd.queue_mode = ret;
+
+	ret = match_string(sbdd_ioprio_policy_names,
+			   ARRAY_SIZE(sbdd_ioprio_policy_names), __sbdd_ioprio_policy);
+	if (ret < 0) {
+		pr_err("unknown ioprio policy %s\n", __sbdd_ioprio_policy);
+		return ret;
+	}
+	__sbdd.ioprio_policy = ret;
 
-	pr_info("allocating data\n");
 	__sbdd.capacity = (sector_t)__sbdd_capacity_mib * SBDD_MIB_SECTORS;
-	__sbdd.data = vzalloc(__sbdd.capacity << SBDD_SECTOR_SHIFT);
-	if (!__sbdd.data) {
-		pr_err("unable to alloc data\n");
+	if (__sbdd.store != SBDD_STORE_VMALLOC || !__sbdd_lazy_zero)
+		__sbdd.zero_complete = true;
+
+	__sbdd.stats = alloc_percpu(struct sbdd_stats);
+	if (!__sbdd.stats) {
+		pr_err("unable to alloc stats\n");
+		return -ENOMEM;
+	}
+
+	__sbdd.copy_wq = alloc_workqueue("sbdd_copy",
+					 WQ_UNBOUND | WQ_HIGHPRI | WQ_MEM_RECLAIM, 0);
+	if (!__sbdd.copy_wq) {
+		pr_err("unable to alloc copy workqueue\n");
 		return -ENOMEM;
 	}
 
-	spin_lock_init(&__sbdd.datalock);
+	if (__sbdd.store == SBDD_STORE_SHMEM) {
+		pr_info("creating shmem file\n");
+		__sbdd.shmem = shmem_file_setup(SBDD_NAME, (loff_t)__sbdd.capacity <<
+						SBDD_SECTOR_SHIFT, VM_NORESERVE);
+		if (IS_ERR(__sbdd.shmem)) {
+			pr_err("unable to create shmem file\n");
+			ret = PTR_ERR(__sbdd.shmem);
+			__sbdd.shmem = NULL;
+			return ret;
+		}
+	}
+
+	if (__sbdd.store == SBDD_STORE_PHYS) {
+		pr_info("mapping phys region\n");
+		ret = sbdd_phys_map();
+		if (ret) {
+			pr_err("unable to map phys region\n");
+			return ret;
+		}
+		register_reboot_notifier(&__sbdd_phys_reboot_nb);
+		__sbdd.phys_reboot_nb = true;
+	}
+
+	if (__sbdd.store == SBDD_STORE_VMALLOC) {
+		pr_info("allocating data\n");
+		/* Lazy zeroing leaves it to sbdd_zero_start() */
+		if (sbdd_segs_alloc(!__sbdd_lazy_zero)) {
+			pr_err("unable to alloc data\n");
+			return -ENOMEM;
+		}
+	}
+
+	for (i = 0; i < SBDD_LOCK_STRIPES; i++)
+		spin_lock_init(&__sbdd.datalocks[i].lock);
 	init_waitqueue_head(&__sbdd.exitwait);
 
+	if (__sbdd.store == SBDD_STORE_PAGES) {
+		pr_info("registering shrinker\n");
+		ret = sbdd_shrinker_register();
+		if (ret) {
+			pr_err("unable to register shrinker\n");
+			return ret;
+		}
+	}
+
+	if (!__sbdd.zero_complete) {
+		pr_info("starting lazy zeroing\n");
+		ret = sbdd_zero_start();
+		if (ret) {
+			pr_err("unable to start zeroing\n");
+			return ret;
+		}
+	}
+
+	__sbdd.copy_engine = SBDD_COPY_AUTO;
+	__sbdd.copy_nt_min_kb = SBDD_NT_MIN_KB;
+	__sbdd.copy_simd_min_kb = SBDD_SIMD_MIN_KB;
+	__sbdd.parallel_chunk_kb = SBDD_PARALLEL_CHUNK_KB;
+	__sbdd.lock_hold_kb = SBDD_LOCK_HOLD_KB;
+	__sbdd.resched_kb = SBDD_RESCHED_KB;
+	__sbdd.latency_us = __sbdd_latency_us;
+	__sbdd.prio_weight_rt = SBDD_PRIO_WEIGHT_RT;
+	__sbdd.prio_weight_be = SBDD_PRIO_WEIGHT_BE;
+	__sbdd.prio_weight_idle = SBDD_PRIO_WEIGHT_IDLE;
+	mutex_init(&__sbdd.ctl_lock);
+
+	spin_lock_init(&__sbdd.lat_lock);
+	init_waitqueue_head(&__sbdd.lat_wait);
+	if (__sbdd.queue_mode == SBDD_QUEUE_BIO && __sbdd_latency_depth) {
+		pr_info("starting latency dispatchers\n");
+		ret = sbdd_lat_start();
+		if (ret) {
+			pr_err("unable to start latency dispatchers\n");
+			return ret;
+		}
+	}
+
+	pr_info("registering control device\n");
+	ret = misc_register(&__sbdd_ctl);
+	if (ret) {
+		pr_err("misc_register() failed\n");
+		return ret;
+	}
+	__sbdd.ctl_registered = true;
+
+	ret = misc_register(&__sbdd_mem);
+	if (ret) {
+		pr_err("misc_register() failed\n");
+		return ret;
+	}
+	__sbdd.mem_registered = true;
+
+	/* The disk waits for SBDD_IOC_ATTACH_MEMFD */
+	if (__sbdd.store == SBDD_STORE_MEMFD) {
+		if (__sbdd_image)
+			pr_warn("image ignored for store=memfd\n");
+		return 0;
+	}
+
+	if (__sbdd_image) {
+		pr_info("seeding from %s\n", __sbdd_image);
+		ret = sbdd_seed();
+		if (ret) {
+			pr_err("unable to seed from %s\n", __sbdd_image);
+			return ret;
+		}
+	}
+
+	/* The control device is up, with async_init a delete can race */
+	mutex_lock(&__sbdd.ctl_lock);
+	ret = atomic_read(&__sbdd.deleting) ? -ENODEV : sbdd_add_disk();
+	mutex_unlock(&__sbdd.ctl_lock);
+
+	return ret;
+}
+
+/* Turns the comma separated features parameter into BLK_FEAT_* flags */
+static int sbdd_parse_features(blk_features_t *features)
+{
+	char *buf, *cur, *name;
+	int ret = 0;
+
+	buf = kstrdup(__sbdd_features, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	cur = buf;
+	while ((name = strsep(&cur, ",")) != NULL) {
+		if (!*name)
+			continue;
+		ret = match_string(sbdd_feature_names, SBDD_FEAT_NR, name);
+		if (ret < 0) {
+			pr_err("unknown feature %s\n", name);
+			break;
+		}
+		*features |= sbdd_feature_flags[ret];
+		ret = 0;
+	}
+	kfree(buf);
+
+	return ret;
+}
+
+static void sbdd_uevent(struct kobject *kobj, const char *var)
+{
+	char *envp[] = { (char *)var, NULL };
+
+	kobject_uevent_env(kobj, KOBJ_CHANGE, envp);
+}
+
+static int sbdd_add_disk(void)
+{
+	struct queue_limits limits = { 0 };
+	int ret;
+
 	/* Configure queue */
 	limits.logical_block_size = SBDD_SECTOR_SIZE;
 	limits.physical_block_size = SBDD_SECTOR_SIZE;
+	limits.max_hw_sectors = __sbdd_max_hw_kb << 1;
+	limits.io_min = __sbdd_io_min;
+	limits.io_opt = __sbdd_io_opt;
+	ret = sbdd_parse_features(&limits.features);
+	if (ret)
+		return ret;
 
 	pr_info("allocating disk\n");
-	__sbdd.gd = blk_alloc_disk(&limits, NUMA_NO_NODE);
+	if (__sbdd.queue_mode == SBDD_QUEUE_MQ)
+		__sbdd.gd = sbdd_alloc_mq_disk(&limits);
+	else
+		__sbdd.gd = blk_alloc_disk(&limits, NUMA_NO_NODE);
 	if (IS_ERR(__sbdd.gd)) {
 		pr_err("blk_alloc_disk() failed\n");
 		ret = PTR_ERR(__sbdd.gd);
@@ -136,41 +3771,154 @@ static int sbdd_create(void)
 	}
 
 	/* Configure gendisk */
-	__sbdd.gd->fops = &__sbdd_bdev_ops;
+	__sbdd.gd->fops = __sbdd.queue_mode == SBDD_QUEUE_MQ ?
+			  &__sbdd_mq_bdev_ops : &__sbdd_bdev_ops;
 	__sbdd.gd->private_data = &__sbdd;
 	scnprintf(__sbdd.gd->disk_name, DISK_NAME_LEN, SBDD_NAME);
 	set_capacity(__sbdd.gd, __sbdd.capacity);
+	/* Before the disk is added, nobody may see it writable */
+	set_disk_ro(__sbdd.gd, __sbdd.read_only);
+	if (__sbdd_no_part_scan)
+		__sbdd.gd->flags |= GENHD_FL_NO_PART;
 	atomic_set(&__sbdd.refs_cnt, 1);
 
+	/* From here on the region may be written */
+	if (__sbdd.phys_sb)
+		sbdd_phys_set_clean(false);
+
 	/*
 	Allocating gd does not make it available, add_disk() is required.
 	After this call, gd methods can be called at any time. Should not be
 	called before the driver is fully initialized and ready to process reqs.
 	*/
 	pr_info("adding disk\n");
-	ret = add_disk(__sbdd.gd);
-	if (ret)
+	ret = device_add_disk(NULL, __sbdd.gd, sbdd_attr_groups);
+	if (ret) {
 		pr_err("add_disk() failed\n");
+		put_disk(__sbdd.gd);
+		__sbdd.gd = NULL;
+		if (__sbdd.phys_state == SBDD_PHYS_ADOPTED_CLEAN)
+			sbdd_phys_set_clean(true);
+		if (__sbdd.tag_set.ops) {
+			blk_mq_free_tag_set(&__sbdd.tag_set);
+			__sbdd.tag_set.ops = NULL;
+		}
+		return ret;
+	}
 
-	return ret;
+	__sbdd.disk_added = true;
+
+	/* The add event comes before partitions are scanned, this one after */
+	sbdd_uevent(&disk_to_dev(__sbdd.gd)->kobj, "SBDD_READY=1");
+	return 0;
 }
 
-static void sbdd_delete(void)
+/*
+Fails new I/O, waits for the bios in flight and removes the disk. Called
+by SBDD_IOC_DELETE while the disk may still be open and loaded, and at
+module unload, when nobody can have it open anymore. Openers keep the
+gendisk and the module until they close it, their I/O fails meanwhile.
+*/
+static void sbdd_remove_disk(void)
 {
-	atomic_set(&__sbdd.deleting, 1);
+	ktime_t start = ktime_get();
+
+	if (atomic_xchg(&__sbdd.deleting, 1))
+		return;
+
 	atomic_dec_if_positive(&__sbdd.refs_cnt);
 	wait_event(__sbdd.exitwait, !atomic_read(&__sbdd.refs_cnt));
 
+	/* tools/stress-unload.sh collects this one */
+	pr_info("drained in %lld us\n", ktime_us_delta(ktime_get(), start));
+
+	/* Waits for the workers which put the last references to return */
+	if (__sbdd.copy_wq)
+		flush_workqueue(__sbdd.copy_wq);
+	sbdd_lat_stop();
+
 	/* gd will be removed only after the last reference put */
 	if (__sbdd.gd) {
+		if (__sbdd.tag_set.ops)
+			sbdd_mq_end_parked();
 		pr_info("deleting disk\n");
 		del_gendisk(__sbdd.gd);
 		put_disk(__sbdd.gd);
+		__sbdd.gd = NULL;
 	}
+}
 
-	if (__sbdd.data) {
+static void sbdd_delete(void)
+{
+	if (__sbdd.ctl_registered)
+		misc_deregister(&__sbdd_ctl);
+	if (__sbdd.mem_registered)
+		misc_deregister(&__sbdd_mem);
+
+	sbdd_remove_disk();
+
+	if (__sbdd.tag_set.ops)
+		blk_mq_free_tag_set(&__sbdd.tag_set);
+
+	sbdd_zero_stop();
+
+	if (__sbdd.segs) {
 		pr_info("freeing data\n");
-		vfree(__sbdd.data);
+		sbdd_segs_free();
+	}
+
+	if (__sbdd.copy_wq)
+		destroy_workqueue(__sbdd.copy_wq);
+
+	/* Waits for a running scan to finish */
+	if (__sbdd.shrinker)
+		shrinker_free(__sbdd.shrinker);
+
+	if (__sbdd.store == SBDD_STORE_PAGES) {
+		pr_info("freeing pages\n");
+		sbdd_pages_free();
+	}
+
+	if (__sbdd.shmem) {
+		pr_info("releasing shmem file\n");
+		fput(__sbdd.shmem);
+	}
+
+	if (__sbdd.phys_reboot_nb)
+		unregister_reboot_notifier(&__sbdd_phys_reboot_nb);
+
+	/*
+	The contents stay in the region for the next load. Nothing can have it
+	open or mapped at unload and all I/O has drained. If the disk never
+	came up, the flag is left the way the region was found.
+	*/
+	if (__sbdd.phys_sb) {
+		pr_info("unmapping phys region\n");
+		if (__sbdd.disk_added)
+			sbdd_phys_set_clean(true);
+		memunmap(__sbdd.phys_sb);
+	}
+
+	free_percpu(__sbdd.stats);
+}
+
+/*
+With async_init module load returns right away and the store is built here.
+A failure leaves the partial state to sbdd_exit(), which waits for this
+work first, and is reported by a change event of the module.
+*/
+static void sbdd_init_work(struct work_struct *work)
+{
+	char var[32];
+	int ret;
+
+	ret = sbdd_create();
+	if (ret) {
+		pr_err("initialization failed\n");
+		snprintf(var, sizeof(var), "SBDD_ERROR=%d", ret);
+		sbdd_uevent(&THIS_MODULE->mkobj.kobj, var);
+	} else {
+		pr_info("initialization complete\n");
 	}
 }
 
@@ -184,6 +3932,12 @@ static int __init sbdd_init(void)
 	int ret = 0;
 
 	pr_info("starting initialization...\n");
+	if (__sbdd_async_init) {
+		INIT_WORK(&__sbdd.init_work, sbdd_init_work);
+		queue_work(system_unbound_wq, &__sbdd.init_work);
+		return 0;
+	}
+
 	ret = sbdd_create();
 
 	if (ret) {
@@ -204,6 +3958,8 @@ directly into the kernel). There is also __exitdata note.
 static void __exit sbdd_exit(void)
 {
 	pr_info("exiting...\n");
+	if (__sbdd_async_init)
+		flush_work(&__sbdd.init_work);
 	sbdd_delete();
 	pr_info("exiting complete\n");
 }
@@ -217,6 +3973,60 @@ module_exit(sbdd_exit);
 /* Set desired capacity with insmod */
 module_param_named(capacity_mib, __sbdd_capacity_mib, ulong, S_IRUGO);
 
+/* Backing store: vmalloc (default), pages (sparse, allocated on write), shmem,
+memfd (attached through /dev/sbdd-ctl, capacity_mib is ignored) or phys */
+module_param_named(store, __sbdd_store, charp, S_IRUGO);
+
+/* Return from module load at once, build the store and add the disk on a worker */
+module_param_named(async_init, __sbdd_async_init, bool, S_IRUGO);
+
+/* Do not scan the disk for partitions when it is added */
+module_param_named(no_part_scan, __sbdd_no_part_scan, bool, S_IRUGO);
+
+/* Comma separated queue features: rotational, add_random, nowait,
+stable_writes, synchronous. Empty leaves the block layer defaults */
+module_param_named(features, __sbdd_features, charp, S_IRUGO);
+
+/* Queue limits in bytes (io_min, io_opt, 0 is unset) and KiB (max_hw_kb) */
+module_param_named(io_min, __sbdd_io_min, uint, S_IRUGO);
+module_param_named(io_opt, __sbdd_io_opt, uint, S_IRUGO);
+module_param_named(max_hw_kb, __sbdd_max_hw_kb, uint, S_IRUGO);
+
+/* Emulated service time per bio in bio mode, 0 (default) serves bios inline */
+module_param_named(latency_us, __sbdd_latency_us, uint, S_IRUGO);
+
+/* Dispatcher threads serving bios in parallel when latency_us is set */
+module_param_named(latency_depth, __sbdd_latency_depth, uint, S_IRUGO);
+
+/* Dispatch order of emulated latency mode: none, strict or weighted */
+module_param_named(ioprio_policy, __sbdd_ioprio_policy, charp, S_IRUGO);
+
+/* Firmware blob, optionally zstd compressed, the store is filled with at load */
+module_param_named(image, __sbdd_image, charp, S_IRUGO);
+
+/* Physical region of store=phys, its size less one header page is the capacity.
+Without phys_addr a reserved-memory node compatible with "sbdd,phys" is used */
+module_param_named(phys_addr, __sbdd_phys_addr, ulong, S_IRUGO);
+module_param_named(phys_size, __sbdd_phys_size, ulong, S_IRUGO);
+
+/* Queue mode: bio (default) or mq, the rest only applies to mq */
+module_param_named(queue_mode, __sbdd_queue_mode, charp, S_IRUGO);
+
+/* Submission queues, 0 means one per online cpu */
+module_param_named(hw_queues, __sbdd_hw_queues, uint, S_IRUGO);
+
+/* Queues for polled I/O, their completions are reaped by ->poll() */
+module_param_named(poll_queues, __sbdd_poll_queues, uint, S_IRUGO);
+
+/* Tags per hardware queue */
+module_param_named(queue_depth, __sbdd_queue_depth, uint, S_IRUGO);
+
+/* Skip zeroing the vmalloc store at load, zero it in the background instead */
+module_param_named(lazy_zero, __sbdd_lazy_zero, bool, S_IRUGO);
+
+/* Background zeroing threads, 0 means one per online cpu */
+module_param_named(zero_threads, __sbdd_zero_threads, uint, S_IRUGO);
+
 /* Note for the kernel: a free license module. A warning will be outputted without it. */
 MODULE_LICENSE("GPL");
 MODULE_DESCRIPTION("Simple Block Device Driver");
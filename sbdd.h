@@ -0,0 +1,94 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+#ifndef _UAPI_SBDD_H
+#define _UAPI_SBDD_H
+
+/*
+Userspace interface of sbdd. Ioctls of the control device /dev/sbdd-ctl
+require CAP_SYS_ADMIN, SBDD_IOC_COPY_RANGE is issued on the block device.
+/dev/sbdd-mem has no ioctls, mmap() of it maps the device contents at
+offset 0.
+*/
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define SBDD_CTL_NAME           "sbdd-ctl"
+#define SBDD_MEM_NAME           "sbdd-mem"
+#define SBDD_IOC_MAGIC          0xdb
+
+/*
+SBDD_IOC_ATTACH_MEMFD, store=memfd only: sbdd serves the disk from the
+pages of memfd, which must be sealed with F_SEAL_SHRINK. The disk shows up
+once attached and its capacity is the memfd size rounded down to sectors,
+returned in size. A memfd sealed with F_SEAL_WRITE or F_SEAL_FUTURE_WRITE
+makes the disk read only, any other must carry F_SEAL_SEAL so that no write
+seal can be added while the disk writes to it. -EINVAL otherwise.
+*/
+struct sbdd_attach {
+	__s32                   memfd;
+	__u32                   flags;          /* must be 0 */
+	__u64                   size;           /* out */
+};
+
+#define SBDD_IOC_ATTACH_MEMFD   _IOWR(SBDD_IOC_MAGIC, 1, struct sbdd_attach)
+
+/*
+SBDD_IOC_VIO: reads (or with SBDD_VIO_WRITE writes) every (sector,
+nr_sectors, buf) tuple of vecs in one call, with no bio per tuple. Buffers
+must be 512 bytes aligned. Also accepted as an io_uring IORING_OP_URING_CMD
+on /dev/sbdd-ctl with cmd_op SBDD_IOC_VIO and struct sbdd_vio in sqe->cmd,
+completing with a single CQE. It is served inline when buffers and vector
+are resident and nothing has to wait, from io-wq otherwise. Returns the
+number of bytes transferred. Like an O_DIRECT write to the whole disk,
+a write flushes dirty page cache over the tuples first and drops the cached
+pages afterwards.
+*/
+struct sbdd_vec {
+	__u64                   sector;
+	__u32                   nr_sectors;
+	__u32                   pad;
+	__u64                   buf;
+};
+
+#define SBDD_VIO_WRITE          (1U << 0)
+#define SBDD_VIO_MAX_VECS       256
+
+struct sbdd_vio {
+	__u64                   vecs;           /* struct sbdd_vec array */
+	__u32                   nr_vecs;
+	__u32                   flags;
+};
+
+#define SBDD_IOC_VIO            _IOW(SBDD_IOC_MAGIC, 2, struct sbdd_vio)
+
+/*
+SBDD_IOC_COPY_RANGE, on the sbdd block device opened for writing: copies
+nr_sectors from src_sector to dst_sector inside the device, sectors being
+relative to the opened partition. The ranges must not overlap. Whole pages
+of store=pages are cloned and shared until either side is written, unless
+SBDD_RANGE_NOCLONE asks for a copy, every other store copies in memory.
+dst_fd is -1 or an fd of the destination block device, which has to be the
+one the ioctl is issued on (-EXDEV for any other disk). Dirty page cache of
+both ranges is written back first and the destination's is invalidated
+afterwards.
+*/
+struct sbdd_range {
+	__u64                   src_sector;
+	__u64                   dst_sector;
+	__u64                   nr_sectors;
+	__s32                   dst_fd;
+	__u32                   flags;
+};
+
+#define SBDD_RANGE_NOCLONE      (1U << 0)
+
+#define SBDD_IOC_COPY_RANGE     _IOW(SBDD_IOC_MAGIC, 3, struct sbdd_range)
+
+/*
+SBDD_IOC_DELETE: fails new I/O, waits for the bios in flight and removes
+the disk even if it is open. Openers get errors until they close it, after
+which the module can be unloaded. The store is kept until then.
+*/
+#define SBDD_IOC_DELETE         _IO(SBDD_IOC_MAGIC, 4)
+
+#endif /* _UAPI_SBDD_H */
@@ -0,0 +1,87 @@
+#!/bin/sh
+# Finds the bio sizes from which sbdd's non-temporal write and SIMD read
+# copies beat plain memcpy on this machine.
+#
+# Every engine is forced through /sys/block/sbdd/sbdd/copy_engine and timed
+# with sequential sbdd-load jobs over a range of block sizes. The smallest
+# size from which an engine stays ahead of memcpy becomes the threshold, -a
+# writes the thresholds to sysfs and switches the device back to auto.
+#
+# Output is CSV on stdout: dir,bs_kb,engine,mib_s followed by the result.
+
+set -u
+
+LOAD=${LOAD:-$(dirname "$0")/sbdd-load}
+DEV=${DEV:-/dev/sbdd}
+SYS=${SYS:-/sys/block/$(basename "$DEV")/sbdd}
+SIZES=${SIZES:-"4 16 64 128 256 512 1024 2048 4096"}
+RUNTIME=${RUNTIME:-3}
+THREADS=${THREADS:-1}
+APPLY=0
+
+while getopts "ad:t:T:" opt; do
+	case $opt in
+	a) APPLY=1 ;;
+	d) DEV=$OPTARG; SYS=/sys/block/$(basename "$DEV")/sbdd ;;
+	t) THREADS=$OPTARG ;;
+	T) RUNTIME=$OPTARG ;;
+	*) echo "usage: $0 [-a] [-d dev] [-t threads] [-T runtime]" >&2; exit 1 ;;
+	esac
+done
+
+ENGINES=$(tr -d '[]' < "$SYS/copy_engine" | tr ' ' '\n' | grep -v -e auto -e memcpy)
+ORIG=$(sed 's/.*\[\(.*\)\].*/\1/' "$SYS/copy_engine")
+
+run() {
+	echo "$3" > "$SYS/copy_engine"
+	"$LOAD" -d "$DEV" -p seq -r "$1" -b "${2}k" -t "$THREADS" -c 0-$((THREADS - 1)) \
+		-q 4 -T "$RUNTIME" | awk '/^total/ { print $5 }'
+}
+
+# Prints the smallest size from which $engine beats memcpy at every size
+crossover() {
+	awk -F, -v dir="$1" -v engine="$2" '
+		$1 == dir && $3 == "memcpy" { base[$2] = $4 }
+		$1 == dir && $3 == engine { mine[$2] = $4; sizes[++n] = $2 }
+		END {
+			best = ""
+			for (i = n; i >= 1; i--) {
+				if (mine[sizes[i]] <= base[sizes[i]])
+					break
+				best = sizes[i]
+			}
+			print best
+		}' "$RESULTS"
+}
+
+RESULTS=$(mktemp)
+trap 'echo "$ORIG" > "$SYS/copy_engine"; rm -f "$RESULTS"' EXIT
+
+echo "dir,bs_kb,engine,mib_s"
+for dir in write read; do
+	pct=0
+	[ "$dir" = read ] && pct=100
+	for bs in $SIZES; do
+		for engine in memcpy $ENGINES; do
+			echo "$dir,$bs,$engine,$(run $pct "$bs" "$engine")"
+		done
+	done
+done | tee "$RESULTS"
+
+nt=$(crossover write nt)
+# Auto mode reads with the widest SIMD engine the CPU has
+simd=
+for engine in avx512 avx2; do
+	echo "$ENGINES" | grep -qx "$engine" || continue
+	simd=$(crossover read "$engine")
+	break
+done
+
+echo "copy_nt_min_kb=${nt:-none} copy_simd_min_kb=${simd:-none}"
+
+if [ "$APPLY" = 1 ]; then
+	# No crossover means the engine never wins, push it out of reach
+	echo "${nt:-4294967295}" > "$SYS/copy_nt_min_kb"
+	echo "${simd:-4294967295}" > "$SYS/copy_simd_min_kb"
+	ORIG=auto
+fi
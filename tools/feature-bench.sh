@@ -0,0 +1,48 @@
+#!/bin/sh
+# Small I/O latency against the queue feature profile.
+#
+# The module is loaded once per profile, the first one being the block
+# layer defaults and every following one adding a single feature to the
+# default profile or taking one away. 4k random reads and then writes run
+# at queue depth 1 on one pinned thread; nowait only makes a difference
+# with io_uring, which sbdd-load is, as it lets the submission complete
+# inline instead of being punted to an io-wq worker. synchronous is left out:
+# it is no longer a default, only the swap-in path looks at it and it is
+# only true with parallel_min_kb, plug_batch and latency_us at 0. Add it to
+# PROFILES to check that it does not cost anything either.
+#
+# Output is CSV on stdout: features,rw,iops,p50_us,p99_us,p999_us
+
+set -u
+
+HERE=$(dirname "$0")
+MODULE=${MODULE:-$HERE/sbdd.ko}
+[ -f "$MODULE" ] || MODULE=$HERE/../sbdd.ko
+LOAD=${LOAD:-$HERE/sbdd-load}
+DEV=${DEV:-/dev/sbdd}
+RUNTIME=${RUNTIME:-10}
+MODARGS=${MODARGS:-}
+PROFILES=${PROFILES:-"- nowait nowait,rotational nowait,add_random
+nowait,stable_writes"}
+
+lat() {
+	"$LOAD" -d "$DEV" -t 1 -c 0 -q 1 -b 4k -r "$1" -T "$RUNTIME" |
+		awk '/^(read|write)/ { print $3 "," $11 "," $15 "," $17 }'
+}
+
+echo "features,rw,iops,p50_us,p99_us,p999_us"
+
+for profile in $PROFILES; do
+	features=$profile
+	[ "$profile" = - ] && features=
+	insmod "$MODULE" features="$features" $MODARGS || exit 1
+	udevadm settle
+
+	# Write once so reads of the sparse store do not hit holes
+	dd if=/dev/zero of="$DEV" bs=4M oflag=direct status=none
+
+	echo "$profile,read,$(lat 100)"
+	echo "$profile,write,$(lat 0)"
+
+	rmmod sbdd || exit 1
+done
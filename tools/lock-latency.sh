@@ -0,0 +1,66 @@
+#!/bin/sh
+# Checks that small reads stay fast while large writes run.
+#
+# A baseline of 4k random reads at queue depth 1 is taken on an idle device,
+# then the same reads run next to sequential multi-megabyte writers for every
+# lock_hold_kb value given. The script fails if read p99 under load grows
+# more than MAX_RATIO times over the baseline for the default setting.
+#
+# Output is CSV on stdout: lock_hold_kb,writers,p50_us,p99_us,p999_us
+
+set -u
+
+LOAD=${LOAD:-$(dirname "$0")/sbdd-load}
+DEV=${DEV:-/dev/sbdd}
+SYS=/sys/block/$(basename "$DEV")
+HOLDS=${HOLDS:-"0 4 32 256 4096"}
+WRITERS=${WRITERS:-2}
+WRITE_BS=${WRITE_BS:-4m}
+RUNTIME=${RUNTIME:-5}
+MAX_RATIO=${MAX_RATIO:-4}
+
+ORIG_HOLD=$(cat "$SYS/sbdd/lock_hold_kb")
+ORIG_MAX=$(cat "$SYS/queue/max_sectors_kb")
+trap 'echo "$ORIG_HOLD" > "$SYS/sbdd/lock_hold_kb"; echo "$ORIG_MAX" > "$SYS/queue/max_sectors_kb"' EXIT
+
+# Let the writers' bios reach the driver whole
+cat "$SYS/queue/max_hw_sectors_kb" > "$SYS/queue/max_sectors_kb"
+
+# Reader on cpu 0, writers on the following ones
+reads() {
+	"$LOAD" -d "$DEV" -t 1 -c 0 -q 1 -b 4k -r 100 -T "$RUNTIME" |
+		awk '/^read/ { print $11 "," $15 "," $17 }'
+}
+
+writers() {
+	"$LOAD" -d "$DEV" -t "$WRITERS" -c 1-"$WRITERS" -q 4 -b "$WRITE_BS" \
+		-p seq -r 0 -T $((RUNTIME + 2)) >/dev/null &
+	sleep 1
+}
+
+echo "lock_hold_kb,writers,p50_us,p99_us,p999_us"
+
+base=$(reads)
+echo "$ORIG_HOLD,0,$base"
+
+for hold in $HOLDS; do
+	echo "$hold" > "$SYS/sbdd/lock_hold_kb"
+	writers
+	line=$(reads)
+	wait
+	echo "$hold,$WRITERS,$line"
+	[ "$hold" = "$ORIG_HOLD" ] && loaded=$line
+done
+
+if [ -z "${loaded:-}" ]; then
+	echo "$ORIG_HOLD" > "$SYS/sbdd/lock_hold_kb"
+	writers
+	loaded=$(reads)
+	wait
+fi
+
+ok=$(echo "$base $loaded" | awk -F'[ ,]' -v r="$MAX_RATIO" '{ print ($5 <= $2 * r) }')
+if [ "$ok" != 1 ]; then
+	echo "read p99 under load ${loaded#*,} exceeds ${MAX_RATIO}x baseline ${base#*,}" >&2
+	exit 1
+fi
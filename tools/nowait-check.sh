@@ -0,0 +1,74 @@
+#!/bin/sh
+# Checks that io_uring serves sbdd I/O inline when nothing has to sleep and
+# that bios which would sleep are bounced instead of blocking the submitter.
+#
+# For every store the module is loaded in bio mode, the device is written
+# once so that the sparse and shmem stores have their pages in place, and a
+# mixed random job runs with sbdd-load --no-punt, which fails as soon as an
+# iou-wrk thread shows up. nowait_again, the number of bios the driver
+# bounced with BLK_STS_AGAIN for io_uring to reissue from io-wq, has to stay
+# 0 then.
+#
+# Every store of EMPTY_STORES then runs the same job without the fill and
+# without --no-punt: writes into holes of the shmem store cannot be served
+# without allocating, so nowait_again has to grow. The sparse store is not
+# in the default list as its GFP_NOWAIT allocations mostly succeed.
+#
+# Output is CSV on stdout: store,filled,iops,iowq_workers,nowait_again
+
+set -u
+
+HERE=$(dirname "$0")
+MODULE=${MODULE:-$HERE/sbdd.ko}
+[ -f "$MODULE" ] || MODULE=$HERE/../sbdd.ko
+LOAD=${LOAD:-$HERE/sbdd-load}
+DEV=${DEV:-/dev/sbdd}
+SYS=/sys/block/$(basename "$DEV")/sbdd
+STORES=${STORES:-"vmalloc pages shmem"}
+EMPTY_STORES=${EMPTY_STORES:-shmem}
+THREADS=${THREADS:-4}
+RUNTIME=${RUNTIME:-10}
+MODARGS=${MODARGS:-}
+
+# run <store> <filled>: prints the CSV line, fails on an unexpected result
+run() {
+	insmod "$MODULE" store="$1" $MODARGS || exit 1
+	udevadm settle
+
+	punt=
+	if [ "$2" = yes ]; then
+		dd if=/dev/zero of="$DEV" bs=4M oflag=direct status=none
+		punt=--no-punt
+	fi
+
+	ret=0
+	out=$("$LOAD" -d "$DEV" -t "$THREADS" -q 32 -b 4k/80:64k/20 -r 70 \
+		-T "$RUNTIME" $punt) || ret=1
+	iops=$(echo "$out" | awk '/^total/ { print $3 }')
+	iowq=$(echo "$out" | awk '/^io-wq workers/ { print $3 }')
+	again=$(cat "$SYS/nowait_again")
+	echo "$1,$2,$iops,$iowq,$again"
+
+	if [ "$2" = yes ] && [ "$again" -ne 0 ]; then
+		echo "$1: bios were bounced" >&2
+		ret=1
+	elif [ "$2" = no ] && [ "$again" -eq 0 ]; then
+		echo "$1: no bio was bounced" >&2
+		ret=1
+	fi
+
+	rmmod sbdd || exit 1
+	return $ret
+}
+
+echo "store,filled,iops,iowq_workers,nowait_again"
+
+fail=0
+for store in $STORES; do
+	run "$store" yes || fail=1
+done
+for store in $EMPTY_STORES; do
+	run "$store" no || fail=1
+done
+
+exit $fail
@@ -0,0 +1,52 @@
+#!/bin/sh
+# Read latency of each io priority class under contention.
+#
+# The module is loaded in bio mode with emulated latency, once per ioprio
+# policy. Best effort writers keep the dispatchers saturated and an idle
+# class writer soaks up what is left, meanwhile a single 4k reader at queue
+# depth 1 is run in each class in turn. With policy none all classes share
+# one FIFO, which is the baseline the other two are compared to.
+#
+# Output is CSV on stdout: policy,class,iops,p50_us,p99_us,p999_us
+
+set -u
+
+HERE=$(dirname "$0")
+MODULE=${MODULE:-$HERE/sbdd.ko}
+[ -f "$MODULE" ] || MODULE=$HERE/../sbdd.ko
+LOAD=${LOAD:-$HERE/sbdd-load}
+DEV=${DEV:-/dev/sbdd}
+POLICIES=${POLICIES:-"none strict weighted"}
+CLASSES=${CLASSES:-"rt be idle"}
+LATENCY_US=${LATENCY_US:-20}
+DEPTH=${DEPTH:-4}
+WRITERS=${WRITERS:-4}
+RUNTIME=${RUNTIME:-10}
+MODARGS=${MODARGS:-}
+
+load_time=$(( (RUNTIME + 1) * $(echo $CLASSES | wc -w) + 1 ))
+
+echo "policy,class,iops,p50_us,p99_us,p999_us"
+
+for policy in $POLICIES; do
+	insmod "$MODULE" queue_mode=bio latency_us="$LATENCY_US" \
+		latency_depth="$DEPTH" ioprio_policy="$policy" $MODARGS || exit 1
+	udevadm settle
+	dd if=/dev/zero of="$DEV" bs=4M oflag=direct status=none
+
+	"$LOAD" -d "$DEV" -t "$WRITERS" -q 32 -b 64k -r 0 -T "$load_time" \
+		--ioprio be >/dev/null &
+	"$LOAD" -d "$DEV" -t 1 -q 32 -b 64k -r 0 -T "$load_time" \
+		--ioprio idle >/dev/null &
+	sleep 1
+
+	for class in $CLASSES; do
+		"$LOAD" -d "$DEV" -t 1 -q 1 -b 4k -r 100 -T "$RUNTIME" \
+			--ioprio "$class" |
+			awk -v p="$policy" -v c="$class" \
+				'$1 == c { print p "," c "," $3 "," $11 "," $15 "," $17 }'
+	done
+	wait
+
+	rmmod sbdd || exit 1
+done
@@ -0,0 +1,72 @@
+#!/bin/sh
+# Boots a debug kernel in QEMU and runs an sbdd job inside it.
+#
+# The kernel tree is expected to be built with debug.config merged in (KASAN,
+# lockdep, atomic sleep checks), warnings panic the guest so that any splat
+# fails the run. The module is built against that tree, the tools statically,
+# and everything is packed with a static busybox into the initramfs.
+#
+#   tools/qemu/run.sh -k ~/linux-debug
+#   tools/qemu/run.sh -k ~/linux-debug -c "ITERS=500 JOBS=8 ./stress-unload.sh"
+
+set -eu
+
+REPO=$(cd "$(dirname "$0")/../.." && pwd)
+KDIR=
+CMD="./stress-unload.sh"
+MEM=${MEM:-4G}
+SMP=${SMP:-4}
+BUSYBOX=${BUSYBOX:-$(command -v busybox || true)}
+
+usage() {
+	echo "usage: $0 -k kernel_build_dir [-c guest_cmd] [-m mem] [-s smp]" >&2
+	exit 1
+}
+
+while getopts "k:c:m:s:h" opt; do
+	case $opt in
+	k) KDIR=$OPTARG ;;
+	c) CMD=$OPTARG ;;
+	m) MEM=$OPTARG ;;
+	s) SMP=$OPTARG ;;
+	*) usage ;;
+	esac
+done
+[ -n "$KDIR" ] || usage
+[ -x "$BUSYBOX" ] || { echo "static busybox is required (BUSYBOX=...)" >&2; exit 1; }
+
+make -C "$KDIR" M="$REPO" modules
+make -C "$REPO/tools" clean
+make -C "$REPO/tools" LDFLAGS=-static
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+ROOT=$WORK/root
+
+mkdir -p "$ROOT/bin" "$ROOT/sbin" "$ROOT/proc" "$ROOT/sys" "$ROOT/dev" "$ROOT/sbdd"
+cp "$BUSYBOX" "$ROOT/bin/busybox"
+for app in $("$BUSYBOX" --list); do
+	ln -sf busybox "$ROOT/bin/$app"
+done
+ln -sf ../bin/busybox "$ROOT/sbin/insmod"
+ln -sf ../bin/busybox "$ROOT/sbin/rmmod"
+ln -sf ../bin/busybox "$ROOT/sbin/lsmod"
+
+cp "$REPO/sbdd.ko" "$ROOT/sbdd/"
+cp "$REPO"/tools/*.sh "$ROOT/sbdd/"
+find "$REPO/tools" -maxdepth 1 -type f -perm -u+x ! -name "*.sh" \
+	-exec cp {} "$ROOT/sbdd/" \;
+cp "$REPO/tools/qemu/init" "$ROOT/init"
+chmod +x "$ROOT/init" "$ROOT"/sbdd/*
+
+(cd "$ROOT" && find . | cpio -o -H newc --quiet | gzip) > "$WORK/initramfs.gz"
+
+KVM=
+[ -w /dev/kvm ] && KVM="-enable-kvm -cpu host"
+
+qemu-system-x86_64 $KVM -m "$MEM" -smp "$SMP" -nographic -no-reboot \
+	-kernel "$KDIR/arch/x86/boot/bzImage" -initrd "$WORK/initramfs.gz" \
+	-append "console=ttyS0 panic_on_warn=1 oops=panic panic=-1 sbdd_cmd=\"$CMD\"" \
+	| tee "$WORK/console.log"
+
+grep -q "SBDD-QEMU-RESULT: 0" "$WORK/console.log"
@@ -0,0 +1,62 @@
+/*
+sbdd-delete: removes the sbdd disk through /dev/sbdd-ctl.
+
+Unlike rmmod this works while the disk is open, so it is how bios still in
+flight are made to race with teardown. Prints how long the ioctl took,
+which includes draining those bios.
+*/
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "../sbdd.h"
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-C ctl_dev]\n", prog);
+	exit(1);
+}
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+int main(int argc, char **argv)
+{
+	const char *ctl = "/dev/" SBDD_CTL_NAME;
+	uint64_t start;
+	int ctlfd;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "C:h")) != -1) {
+		switch (opt) {
+		case 'C': ctl = optarg; break;
+		default: usage(argv[0]);
+		}
+	}
+
+	ctlfd = open(ctl, O_RDWR | O_CLOEXEC);
+	if (ctlfd < 0) {
+		perror(ctl);
+		return 1;
+	}
+
+	start = now_us();
+	if (ioctl(ctlfd, SBDD_IOC_DELETE)) {
+		perror("SBDD_IOC_DELETE");
+		return 1;
+	}
+
+	printf("deleted in %llu us\n", (unsigned long long)(now_us() - start));
+	return 0;
+}
@@ -0,0 +1,1176 @@
+/*
+sbdd-load: lean io_uring load generator for sbdd.
+
+At the multi-million IOPS level fio's own bookkeeping shows up in profiles,
+so this tool does the bare minimum per I/O: one SQE, one CQE, two clock
+reads and a histogram increment. Each worker owns its ring, its buffers and
+its CPU, nothing is shared on the I/O path.
+
+With --sweep the same job is repeated for 1..N threads and one CSV line is
+printed per point: IOPS, CPU cycles per I/O of the submitting threads and
+the driver's datalock counters, which is what shows how sbdd scales with
+cores.
+
+With --vio N every SQE is an SBDD_IOC_VIO uring_cmd on /dev/sbdd-ctl
+carrying N scattered blocks, each block counts as one I/O, latency is per
+command.
+
+With --ioprio LIST thread i submits with the i-th io priority of LIST and
+one more line per class is printed, which shows what the driver's ioprio
+policy does to the tail latency of each class under contention.
+*/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <linux/fs.h>
+#include <linux/ioprio.h>
+#include <linux/perf_event.h>
+
+#include "uring.h"
+#include "../sbdd.h"
+
+#define MAX_BS_MIX              8
+#define MAX_CPUS                4096
+#define MAX_IOPRIO              64
+#define NR_CLASSES              3
+
+/*
+HDR-style log-linear histogram: values below HIST_SUB are exact, above that
+every power of two is split into HIST_SUB linear buckets, so the relative
+error stays under 1/HIST_SUB from nanoseconds up to minutes.
+*/
+#define HIST_SUB_BITS           7
+#define HIST_SUB                (1U << HIST_SUB_BITS)
+#define HIST_BUCKETS            ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct hist {
+	uint64_t                cnt[HIST_BUCKETS];
+	uint64_t                nr;
+	uint64_t                sum;
+	uint64_t                max;
+};
+
+struct bs_mix {
+	unsigned int            bs;
+	unsigned int            weight;
+};
+
+struct options {
+	const char              *dev;
+	unsigned int            threads;
+	unsigned int            depth;
+	unsigned int            batch;
+	struct bs_mix           bs[MAX_BS_MIX];
+	unsigned int            nr_bs;
+	unsigned int            bs_weight;
+	unsigned int            bs_max;
+	unsigned int            read_pct;
+	int                     random;
+	unsigned int            runtime;
+	int                     sqpoll;
+	int                     iopoll;
+	int                     fixed;
+	int                     cpus[MAX_CPUS];
+	unsigned int            nr_cpus;
+	unsigned long long      offset;
+	unsigned long long      size;
+	int                     sweep;
+	unsigned int            sweep_step;
+	int                     scatter;
+	const char              *stat_dir;
+	unsigned int            vio;
+	const char              *ctl;
+	int                     no_punt;
+	uint16_t                ioprio[MAX_IOPRIO];
+	unsigned int            nr_ioprio;
+};
+
+struct slot {
+	uint64_t                start;
+	unsigned int            len;
+	unsigned int            nr;
+	int                     dir;
+	struct sbdd_vec         *vecs;
+};
+
+struct worker {
+	pthread_t               tid;
+	unsigned int            id;
+	int                     cpu;
+	uint16_t                ioprio;
+	int                     fd;
+	struct uring            ring;
+	struct slot             *slots;
+	struct sbdd_vec         *vecs;
+	void                    *bufs;
+	uint64_t                rng;
+	unsigned long long      seq_pos;
+	unsigned long long      seq_start;
+	unsigned long long      seq_end;
+	unsigned int            inflight;
+	int                     err;
+	int                     perf_fd;
+	uint64_t                cycles;
+	uint64_t                t_start;
+	uint64_t                t_end;
+	uint64_t                ios[2];
+	uint64_t                bytes[2];
+	struct hist             hist[2];
+};
+
+struct result {
+	uint64_t                ios[2];
+	uint64_t                bytes[2];
+	uint64_t                cycles;
+	int                     cycles_ok;
+	uint64_t                lock[2];
+	int                     lock_ok;
+	double                  secs;
+	int                     err;
+	unsigned int            iowq;
+	struct hist             hist[3];
+	uint64_t                cls_ios[NR_CLASSES];
+	uint64_t                cls_bytes[NR_CLASSES];
+	struct hist             cls_hist[NR_CLASSES];
+};
+
+static struct options           opts = {
+	.dev = "/dev/sbdd",
+	.threads = 1,
+	.depth = 32,
+	.batch = 0,
+	.read_pct = 100,
+	.random = 1,
+	.runtime = 10,
+	.fixed = 1,
+	.sweep_step = 1,
+	.ctl = "/dev/" SBDD_CTL_NAME,
+};
+static volatile int             stop;
+static unsigned long long       dev_size;
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint64_t xorshift(uint64_t *s)
+{
+	uint64_t x = *s;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *s = x;
+}
+
+static inline unsigned int hist_index(uint64_t v)
+{
+	unsigned int shift;
+
+	if (v < HIST_SUB)
+		return v;
+
+	shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+	return (shift + 1) * HIST_SUB + (unsigned int)(v >> shift) - HIST_SUB;
+}
+
+static inline uint64_t hist_value(unsigned int idx)
+{
+	unsigned int b = idx / HIST_SUB;
+	unsigned int r = idx % HIST_SUB;
+
+	if (!b)
+		return r;
+
+	return (uint64_t)(HIST_SUB + r) << (b - 1);
+}
+
+static inline void hist_add(struct hist *h, uint64_t v)
+{
+	h->cnt[hist_index(v)]++;
+	h->nr++;
+	h->sum += v;
+	if (v > h->max)
+		h->max = v;
+}
+
+static void hist_merge(struct hist *dst, const struct hist *src)
+{
+	unsigned int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		dst->cnt[i] += src->cnt[i];
+	dst->nr += src->nr;
+	dst->sum += src->sum;
+	if (src->max > dst->max)
+		dst->max = src->max;
+}
+
+static uint64_t hist_percentile(const struct hist *h, double pct)
+{
+	uint64_t want = (uint64_t)(h->nr * pct / 100.0);
+	uint64_t seen = 0;
+	unsigned int i;
+
+	if (want >= h->nr)
+		want = h->nr - 1;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->cnt[i];
+		if (seen > want)
+			return hist_value(i);
+	}
+
+	return h->max;
+}
+
+static unsigned long long parse_size(const char *s)
+{
+	char *end;
+	unsigned long long v = strtoull(s, &end, 0);
+
+	switch (*end) {
+	case 'g': case 'G': v <<= 10; /* fallthrough */
+	case 'm': case 'M': v <<= 10; /* fallthrough */
+	case 'k': case 'K': v <<= 10; break;
+	default: break;
+	}
+
+	return v;
+}
+
+/* "4k" or "4k/70:64k/30" */
+static int parse_bs(const char *arg)
+{
+	char *s = strdup(arg), *tok, *save = NULL;
+
+	opts.nr_bs = 0;
+	opts.bs_weight = 0;
+	opts.bs_max = 0;
+
+	for (tok = strtok_r(s, ":", &save); tok; tok = strtok_r(NULL, ":", &save)) {
+		char *w = strchr(tok, '/');
+		struct bs_mix *m;
+
+		if (opts.nr_bs == MAX_BS_MIX)
+			goto fail;
+
+		m = &opts.bs[opts.nr_bs++];
+		m->weight = w ? strtoul(w + 1, NULL, 0) : 1;
+		if (w)
+			*w = '\0';
+		m->bs = parse_size(tok);
+		if (!m->bs || m->bs % 512 || !m->weight)
+			goto fail;
+
+		opts.bs_weight += m->weight;
+		if (m->bs > opts.bs_max)
+			opts.bs_max = m->bs;
+	}
+
+	free(s);
+	return opts.nr_bs ? 0 : -1;
+
+fail:
+	free(s);
+	return -1;
+}
+
+/* "0-3,8,10-11" */
+static int parse_cpus(const char *arg)
+{
+	char *s = strdup(arg), *tok, *save = NULL;
+
+	opts.nr_cpus = 0;
+	for (tok = strtok_r(s, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		int lo, hi;
+
+		if (sscanf(tok, "%d-%d", &lo, &hi) != 2)
+			hi = lo = atoi(tok);
+		for (; lo <= hi && opts.nr_cpus < MAX_CPUS; lo++)
+			opts.cpus[opts.nr_cpus++] = lo;
+	}
+
+	free(s);
+	return opts.nr_cpus ? 0 : -1;
+}
+
+static const char * const class_names[NR_CLASSES] = { "rt", "be", "idle" };
+
+/* "rt,be:4,idle", the level defaults to 4, the last entry repeats */
+static int parse_ioprio(const char *arg)
+{
+	char *s = strdup(arg), *tok, *save = NULL, *lvl;
+	unsigned int cls, level;
+
+	opts.nr_ioprio = 0;
+	for (tok = strtok_r(s, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		if (opts.nr_ioprio == MAX_IOPRIO)
+			goto fail;
+
+		level = 4;
+		lvl = strchr(tok, ':');
+		if (lvl) {
+			*lvl++ = 0;
+			level = strtoul(lvl, NULL, 0);
+		}
+		for (cls = 0; cls < NR_CLASSES; cls++)
+			if (!strcmp(tok, class_names[cls]))
+				break;
+		if (cls == NR_CLASSES || level >= IOPRIO_NR_LEVELS)
+			goto fail;
+
+		opts.ioprio[opts.nr_ioprio++] =
+			IOPRIO_PRIO_VALUE(IOPRIO_CLASS_RT + cls, level);
+	}
+
+	free(s);
+	return opts.nr_ioprio ? 0 : -1;
+fail:
+	free(s);
+	return -1;
+}
+
+static unsigned int pick_bs(struct worker *w)
+{
+	unsigned int r, i;
+
+	if (opts.nr_bs == 1)
+		return opts.bs[0].bs;
+
+	r = xorshift(&w->rng) % opts.bs_weight;
+	for (i = 0; r >= opts.bs[i].weight; i++)
+		r -= opts.bs[i].weight;
+
+	return opts.bs[i].bs;
+}
+
+static unsigned long long pick_offset(struct worker *w, unsigned int bs)
+{
+	unsigned long long off;
+
+	if (opts.random)
+		return opts.offset + (xorshift(&w->rng) % (opts.size / bs)) * bs;
+
+	if (w->seq_pos + bs > w->seq_end)
+		w->seq_pos = w->seq_start;
+	off = w->seq_pos;
+	w->seq_pos += bs;
+	return opts.offset + off;
+}
+
+/* One uring_cmd gathering or scattering opts.vio random blocks */
+static void prep_vio(struct worker *w, struct io_uring_sqe *sqe,
+                     struct slot *slot, unsigned int idx)
+{
+	struct sbdd_vio *vio = (struct sbdd_vio *)&sqe->addr3;
+	char *buf = (char *)w->bufs + (size_t)idx * opts.vio * opts.bs_max;
+	unsigned int i, bs;
+
+	slot->len = 0;
+	for (i = 0; i < opts.vio; i++) {
+		bs = pick_bs(w);
+		slot->vecs[i].sector = pick_offset(w, bs) >> 9;
+		slot->vecs[i].nr_sectors = bs >> 9;
+		slot->vecs[i].buf = (unsigned long)(buf + (size_t)i * opts.bs_max);
+		slot->len += bs;
+	}
+	slot->nr = opts.vio;
+
+	sqe->opcode = IORING_OP_URING_CMD;
+	sqe->fd = 0;
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->cmd_op = SBDD_IOC_VIO;
+	vio->vecs = (unsigned long)slot->vecs;
+	vio->nr_vecs = opts.vio;
+	vio->flags = slot->dir ? SBDD_VIO_WRITE : 0;
+}
+
+static int queue_io(struct worker *w, unsigned int idx)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(&w->ring);
+	struct slot *slot = &w->slots[idx];
+	unsigned int bs;
+
+	if (!sqe)
+		return -EBUSY;
+
+	slot->dir = (xorshift(&w->rng) % 100) >= opts.read_pct;
+	sqe->user_data = idx;
+	if (opts.vio) {
+		prep_vio(w, sqe, slot, idx);
+		goto queued;
+	}
+
+	bs = pick_bs(w);
+	slot->len = bs;
+	slot->nr = 1;
+
+	if (opts.fixed) {
+		sqe->opcode = slot->dir ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+		sqe->fd = 0;
+		sqe->flags = IOSQE_FIXED_FILE;
+		sqe->buf_index = idx;
+	} else {
+		sqe->opcode = slot->dir ? IORING_OP_WRITE : IORING_OP_READ;
+		sqe->fd = w->fd;
+	}
+	sqe->addr = (unsigned long)w->bufs + (unsigned long)idx * opts.bs_max;
+	sqe->len = bs;
+	sqe->off = pick_offset(w, bs);
+	sqe->ioprio = w->ioprio;
+
+queued:
+	slot->start = now_ns();
+	w->inflight++;
+	return 0;
+}
+
+static int reap(struct worker *w, int requeue)
+{
+	struct io_uring_cqe *cqe;
+	int nr = 0;
+
+	while ((cqe = uring_peek_cqe(&w->ring))) {
+		unsigned int idx = cqe->user_data;
+		struct slot *slot = &w->slots[idx];
+		uint64_t end = now_ns();
+
+		if (cqe->res != (int)slot->len) {
+			fprintf(stderr, "worker %u: %s failed: %s\n", w->id,
+			        slot->dir ? "write" : "read",
+			        cqe->res < 0 ? strerror(-cqe->res) : "short transfer");
+			w->err = cqe->res < 0 ? cqe->res : -EIO;
+			stop = 1;
+		}
+
+		uring_cqe_seen(&w->ring);
+		w->inflight--;
+		w->ios[slot->dir] += slot->nr;
+		w->bytes[slot->dir] += slot->len;
+		hist_add(&w->hist[slot->dir], end - slot->start);
+		nr++;
+
+		if (requeue && !stop)
+			queue_io(w, idx);
+	}
+
+	return nr;
+}
+
+/* Cycles of this thread in user and kernel mode, the copy runs in the latter */
+static int perf_open(void)
+{
+	struct perf_event_attr attr = { 0 };
+
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = PERF_COUNT_HW_CPU_CYCLES;
+	attr.disabled = 1;
+	attr.exclude_hv = 1;
+
+	return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static int worker_setup(struct worker *w)
+{
+	struct io_uring_params p = { 0 };
+	struct iovec *iov;
+	unsigned int i;
+	int ret;
+
+	if (w->cpu >= 0) {
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(w->cpu, &set);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+			fprintf(stderr, "worker %u: unable to pin to cpu %d\n",
+			        w->id, w->cpu);
+	}
+
+	w->fd = opts.vio ? open(opts.ctl, O_RDWR) :
+	                   open(opts.dev, O_RDWR | O_DIRECT);
+	if (w->fd < 0)
+		return -errno;
+
+	if (opts.sqpoll) {
+		p.flags |= IORING_SETUP_SQPOLL;
+		p.sq_thread_idle = 1000;
+		if (w->cpu >= 0 && opts.nr_cpus > opts.threads) {
+			/* Poller goes to the CPU after the workers' ones */
+			p.flags |= IORING_SETUP_SQ_AFF;
+			p.sq_thread_cpu = opts.cpus[(opts.threads + w->id) % opts.nr_cpus];
+		}
+	}
+	if (opts.iopoll)
+		p.flags |= IORING_SETUP_IOPOLL;
+
+	ret = uring_init(&w->ring, opts.depth, &p);
+	if (ret)
+		return ret;
+
+	/* Buffers are touched here so page faults stay out of the run */
+	w->slots = calloc(opts.depth, sizeof(*w->slots));
+	if (!w->slots || posix_memalign(&w->bufs, 4096, (size_t)opts.depth *
+	                                (opts.vio ?: 1) * opts.bs_max))
+		return -ENOMEM;
+	memset(w->bufs, 0xa5, (size_t)opts.depth * (opts.vio ?: 1) * opts.bs_max);
+
+	/* The driver pins the vio buffers itself, only the file is registered */
+	if (opts.vio) {
+		w->vecs = calloc((size_t)opts.depth * opts.vio, sizeof(*w->vecs));
+		if (!w->vecs)
+			return -ENOMEM;
+		for (i = 0; i < opts.depth; i++)
+			w->slots[i].vecs = w->vecs + (size_t)i * opts.vio;
+		ret = uring_register(&w->ring, IORING_REGISTER_FILES, &w->fd, 1);
+		if (ret)
+			return ret;
+	} else if (opts.fixed) {
+		iov = calloc(opts.depth, sizeof(*iov));
+		if (!iov)
+			return -ENOMEM;
+		for (i = 0; i < opts.depth; i++) {
+			iov[i].iov_base = w->bufs + (size_t)i * opts.bs_max;
+			iov[i].iov_len = opts.bs_max;
+		}
+		ret = uring_register(&w->ring, IORING_REGISTER_BUFFERS, iov, opts.depth);
+		free(iov);
+		if (ret)
+			return ret;
+
+		ret = uring_register(&w->ring, IORING_REGISTER_FILES, &w->fd, 1);
+		if (ret)
+			return ret;
+	}
+
+	w->rng = 0x9e3779b97f4a7c15ULL ^ ((uint64_t)w->id << 32) ^ now_ns();
+	w->seq_start = opts.size / opts.threads * w->id;
+	w->seq_start -= w->seq_start % opts.bs_max;
+	w->seq_end = w->seq_start + opts.size / opts.threads;
+	w->seq_pos = w->seq_start;
+	w->perf_fd = perf_open();
+	return 0;
+}
+
+static void worker_cleanup(struct worker *w)
+{
+	uring_exit(&w->ring);
+	if (w->perf_fd >= 0)
+		close(w->perf_fd);
+	if (w->fd >= 0)
+		close(w->fd);
+	free(w->slots);
+	free(w->vecs);
+	free(w->bufs);
+}
+
+static void *worker_fn(void *arg)
+{
+	struct worker *w = arg;
+	unsigned int i, pending;
+	int ret;
+
+	ret = worker_setup(w);
+	if (ret) {
+		fprintf(stderr, "worker %u: setup failed: %s\n", w->id, strerror(-ret));
+		w->err = ret;
+		stop = 1;
+		return NULL;
+	}
+
+	if (w->perf_fd >= 0)
+		ioctl(w->perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+	w->t_start = now_ns();
+	for (i = 0; i < opts.depth; i++)
+		queue_io(w, i);
+
+	/*
+	With a batch size the worker waits for that many completions before
+	refilling the ring, otherwise it keeps the queue depth saturated.
+	*/
+	pending = opts.batch ? opts.batch : 1;
+	while (!stop) {
+		ret = uring_submit(&w->ring, opts.iopoll ? 0 : pending);
+		if (ret < 0 && ret != -EAGAIN && ret != -EBUSY) {
+			fprintf(stderr, "worker %u: io_uring_enter: %s\n", w->id,
+			        strerror(-ret));
+			w->err = ret;
+			stop = 1;
+			break;
+		}
+		reap(w, 1);
+	}
+	w->t_end = now_ns();
+	if (w->perf_fd >= 0) {
+		ioctl(w->perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(w->perf_fd, &w->cycles, sizeof(w->cycles)) != sizeof(w->cycles)) {
+			close(w->perf_fd);
+			w->perf_fd = -1;
+		}
+	}
+
+	while (w->inflight) {
+		uring_submit(&w->ring, opts.iopoll ? 0 : 1);
+		reap(w, 0);
+	}
+
+	return NULL;
+}
+
+static void print_line(const char *name, uint64_t ios, uint64_t bytes,
+                       const struct hist *h, double secs)
+{
+	if (!ios)
+		return;
+
+	printf("%-6s: %10.0f IOPS %9.1f MiB/s  lat(us) avg %8.2f p50 %8.2f "
+	       "p90 %8.2f p99 %8.2f p99.9 %8.2f p99.99 %8.2f max %9.2f\n",
+	       name, ios / secs, bytes / secs / (1 << 20),
+	       h->sum / (double)h->nr / 1000.0,
+	       hist_percentile(h, 50) / 1000.0, hist_percentile(h, 90) / 1000.0,
+	       hist_percentile(h, 99) / 1000.0, hist_percentile(h, 99.9) / 1000.0,
+	       hist_percentile(h, 99.99) / 1000.0, h->max / 1000.0);
+}
+
+static int read_ull(const char *dir, const char *name, unsigned long long *v)
+{
+	char path[512];
+	FILE *f;
+	int ret;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	ret = fscanf(f, "%llu", v) == 1 ? 0 : -1;
+	fclose(f);
+	return ret;
+}
+
+/* Driver side datalock counters, see /sys/block/sbdd/sbdd/ */
+static int read_lock_stats(uint64_t lock[2])
+{
+	unsigned long long acquired, contended;
+
+	if (!opts.stat_dir ||
+	    read_ull(opts.stat_dir, "lock_acquired", &acquired) ||
+	    read_ull(opts.stat_dir, "lock_contended", &contended))
+		return -1;
+
+	lock[0] = acquired;
+	lock[1] = contended;
+	return 0;
+}
+
+/*
+Threads io_uring punted requests to show up as iou-wrk-<tid> tasks of this
+process and exit again once idle, so they are sampled while the job runs.
+*/
+static unsigned int count_iowq(void)
+{
+	char path[300], comm[32];
+	struct dirent *de;
+	unsigned int nr = 0;
+	DIR *dir;
+	FILE *f;
+
+	dir = opendir("/proc/self/task");
+	if (!dir)
+		return 0;
+
+	while ((de = readdir(dir))) {
+		if (de->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "/proc/self/task/%s/comm", de->d_name);
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+		if (fgets(comm, sizeof(comm), f) && !strncmp(comm, "iou-wrk", 7))
+			nr++;
+		fclose(f);
+	}
+	closedir(dir);
+
+	return nr;
+}
+
+static int run_round(unsigned int threads, struct result *res)
+{
+	struct worker *workers = calloc(threads, sizeof(*workers));
+	uint64_t lock[2];
+	unsigned int i;
+
+	if (!workers)
+		return -ENOMEM;
+
+	memset(res, 0, sizeof(*res));
+	res->cycles_ok = 1;
+	res->lock_ok = !read_lock_stats(lock);
+
+	stop = 0;
+	opts.threads = threads;
+	for (i = 0; i < threads; i++) {
+		workers[i].id = i;
+		workers[i].cpu = opts.nr_cpus ? opts.cpus[i % opts.nr_cpus] : -1;
+		if (opts.nr_ioprio)
+			workers[i].ioprio = opts.ioprio[i < opts.nr_ioprio ?
+			                                i : opts.nr_ioprio - 1];
+		workers[i].fd = -1;
+		workers[i].perf_fd = -1;
+		workers[i].ring.fd = -1;
+		pthread_create(&workers[i].tid, NULL, worker_fn, &workers[i]);
+	}
+
+	for (i = 0; i < opts.runtime * 10 && !stop; i++) {
+		unsigned int nr;
+
+		usleep(100000);
+		nr = count_iowq();
+		if (nr > res->iowq)
+			res->iowq = nr;
+	}
+	stop = 1;
+
+	for (i = 0; i < threads; i++) {
+		struct worker *w = &workers[i];
+
+		pthread_join(w->tid, NULL);
+		if (w->err)
+			res->err = w->err;
+		res->ios[0] += w->ios[0];
+		res->ios[1] += w->ios[1];
+		res->bytes[0] += w->bytes[0];
+		res->bytes[1] += w->bytes[1];
+		hist_merge(&res->hist[0], &w->hist[0]);
+		hist_merge(&res->hist[1], &w->hist[1]);
+		hist_merge(&res->hist[2], &w->hist[0]);
+		hist_merge(&res->hist[2], &w->hist[1]);
+		if (opts.nr_ioprio) {
+			unsigned int cls = IOPRIO_PRIO_CLASS(w->ioprio) - IOPRIO_CLASS_RT;
+
+			res->cls_ios[cls] += w->ios[0] + w->ios[1];
+			res->cls_bytes[cls] += w->bytes[0] + w->bytes[1];
+			hist_merge(&res->cls_hist[cls], &w->hist[0]);
+			hist_merge(&res->cls_hist[cls], &w->hist[1]);
+		}
+		if (w->perf_fd >= 0)
+			res->cycles += w->cycles;
+		else
+			res->cycles_ok = 0;
+		if (w->t_end > w->t_start && (w->t_end - w->t_start) / 1e9 > res->secs)
+			res->secs = (w->t_end - w->t_start) / 1e9;
+		worker_cleanup(w);
+	}
+	free(workers);
+
+	/* Counters are device wide, the numbers are valid with no other users */
+	if (res->lock_ok) {
+		uint64_t now[2];
+
+		res->lock_ok = !read_lock_stats(now);
+		res->lock[0] = now[0] - lock[0];
+		res->lock[1] = now[1] - lock[1];
+	}
+
+	if (!res->err && !res->secs)
+		res->err = -EIO;
+
+	return res->err;
+}
+
+struct cpu_topo {
+	int                     cpu;
+	int                     pkg;
+	int                     core;
+	int                     smt;
+};
+
+static int topo_read(int cpu, const char *name)
+{
+	char dir[128];
+	unsigned long long v;
+
+	snprintf(dir, sizeof(dir), "/sys/devices/system/cpu/cpu%d/topology", cpu);
+	return read_ull(dir, name, &v) ? 0 : (int)v;
+}
+
+static int topo_cmp_compact(const void *a, const void *b)
+{
+	const struct cpu_topo *x = a, *y = b;
+
+	if (x->pkg != y->pkg)
+		return x->pkg - y->pkg;
+	if (x->smt != y->smt)
+		return x->smt - y->smt;
+	return x->cpu - y->cpu;
+}
+
+static int topo_cmp_scatter(const void *a, const void *b)
+{
+	const struct cpu_topo *x = a, *y = b;
+
+	if (x->smt != y->smt)
+		return x->smt - y->smt;
+	if (x->core != y->core)
+		return x->core - y->core;
+	if (x->pkg != y->pkg)
+		return x->pkg - y->pkg;
+	return x->cpu - y->cpu;
+}
+
+/*
+Orders the allowed CPUs for the sweep. Compact fills one socket with one
+thread per physical core before using SMT siblings and only then moves to
+the next socket. Scatter round-robins sockets first, so cross-socket
+cacheline traffic shows up from two threads on.
+*/
+static struct cpu_topo *build_cpu_order(void)
+{
+	struct cpu_topo *topo = calloc(MAX_CPUS, sizeof(*topo));
+	int *rank = calloc(MAX_CPUS, sizeof(*rank));
+	cpu_set_t set;
+	unsigned int i, j, n = 0;
+
+	if (!topo || !rank || sched_getaffinity(0, sizeof(set), &set)) {
+		free(rank);
+		free(topo);
+		return NULL;
+	}
+
+	for (i = 0; i < CPU_SETSIZE && n < MAX_CPUS; i++) {
+		if (!CPU_ISSET(i, &set))
+			continue;
+		topo[n].cpu = i;
+		topo[n].pkg = topo_read(i, "physical_package_id");
+		topo[n].core = topo_read(i, "core_id");
+		n++;
+	}
+
+	/* smt is the sibling rank inside the core, core becomes a per-socket rank */
+	for (i = 0; i < n; i++)
+		for (j = 0; j < i; j++)
+			if (topo[j].pkg == topo[i].pkg && topo[j].core == topo[i].core)
+				topo[i].smt++;
+	for (i = 0; i < n; i++)
+		for (j = 0; j < n; j++)
+			if (topo[j].pkg == topo[i].pkg && topo[j].core < topo[i].core &&
+			    !topo[j].smt)
+				rank[i]++;
+	for (i = 0; i < n; i++)
+		topo[i].core = rank[i];
+	free(rank);
+
+	qsort(topo, n, sizeof(*topo),
+	      opts.scatter ? topo_cmp_scatter : topo_cmp_compact);
+
+	opts.nr_cpus = n;
+	for (i = 0; i < n; i++)
+		opts.cpus[i] = topo[i].cpu;
+
+	return topo;
+}
+
+static unsigned int count_sockets(unsigned int threads)
+{
+	int seen[MAX_CPUS] = { 0 };
+	unsigned int i, n = 0;
+
+	for (i = 0; i < threads && i < opts.nr_cpus; i++) {
+		int pkg = topo_read(opts.cpus[i], "physical_package_id");
+
+		if (pkg >= 0 && pkg < MAX_CPUS && !seen[pkg]++)
+			n++;
+	}
+
+	return n;
+}
+
+static int run_sweep(void)
+{
+	unsigned int max = opts.nr_cpus, threads;
+	struct result *res = malloc(sizeof(*res));
+
+	if (!res)
+		return 1;
+
+	printf("threads,sockets,iops,read_iops,write_iops,mib_s,cycles_per_io,"
+	       "lock_acquired_per_io,lock_contended_per_io,lock_contended_pct,"
+	       "lat_avg_us,lat_p50_us,lat_p99_us,lat_p999_us\n");
+
+	for (threads = 1; threads <= max; ) {
+		uint64_t ios, bytes;
+		const struct hist *h = &res->hist[2];
+
+		if (run_round(threads, res)) {
+			fprintf(stderr, "round with %u threads failed\n", threads);
+			free(res);
+			return 1;
+		}
+
+		ios = res->ios[0] + res->ios[1];
+		bytes = res->bytes[0] + res->bytes[1];
+		printf("%u,%u,%.0f,%.0f,%.0f,%.1f,", threads, count_sockets(threads),
+		       ios / res->secs, res->ios[0] / res->secs,
+		       res->ios[1] / res->secs, bytes / res->secs / (1 << 20));
+		if (res->cycles_ok)
+			printf("%.0f", res->cycles / (double)ios);
+		printf(",");
+		if (res->lock_ok)
+			printf("%.3f,%.4f,%.2f", res->lock[0] / (double)ios,
+			       res->lock[1] / (double)ios,
+			       res->lock[0] ? 100.0 * res->lock[1] / res->lock[0] : 0.0);
+		else
+			printf(",,");
+		printf(",%.2f,%.2f,%.2f,%.2f\n", h->sum / (double)h->nr / 1000.0,
+		       hist_percentile(h, 50) / 1000.0,
+		       hist_percentile(h, 99) / 1000.0,
+		       hist_percentile(h, 99.9) / 1000.0);
+		fflush(stdout);
+
+		if (threads == max)
+			break;
+		threads += opts.sweep_step;
+		if (threads > max)
+			threads = max;
+	}
+
+	free(res);
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+	        "usage: %s [options]\n"
+	        "  -d, --dev PATH        target device (default /dev/sbdd)\n"
+	        "  -t, --threads N       worker threads (default 1)\n"
+	        "  -q, --depth N         queue depth per thread (default 32)\n"
+	        "  -B, --batch N         completions to wait for before refill\n"
+	        "  -b, --bs SPEC         block size or mix, e.g. 4k or 4k/70:64k/30\n"
+	        "  -r, --read PCT        percentage of reads (default 100)\n"
+	        "  -p, --pattern P       rand or seq (default rand)\n"
+	        "  -T, --runtime SEC     run time in seconds (default 10)\n"
+	        "  -c, --cpus LIST       pin thread i to the i-th cpu of LIST\n"
+	        "  -o, --offset BYTES    start of the tested area\n"
+	        "  -s, --size BYTES      length of the tested area\n"
+	        "  -S, --sqpoll          use an SQ polling thread\n"
+	        "  -P, --iopoll          use polled completions\n"
+	        "  -N, --no-fixed        do not register buffers and files\n"
+	        "      --sweep           run 1..N threads and print CSV, N is the\n"
+	        "                        number of cpus in -c or allowed cpus\n"
+	        "      --step N          thread count increment of the sweep\n"
+	        "      --placement P     compact or scatter cpu order for the sweep\n"
+	        "      --stats DIR       driver stats directory\n"
+	        "                        (default /sys/block/<dev>/sbdd)\n"
+	        "      --vio N           N blocks per SBDD_IOC_VIO uring_cmd\n"
+	        "      --ctl PATH        control device (default /dev/sbdd-ctl)\n"
+	        "      --no-punt         fail if io_uring punted I/O to io-wq\n"
+	        "      --ioprio LIST     io priority of thread i, e.g. rt,be:4,idle,\n"
+	        "                        the last one is used by the rest\n",
+	        prog);
+}
+
+enum {
+	OPT_SWEEP = 256,
+	OPT_STEP,
+	OPT_PLACEMENT,
+	OPT_STATS,
+	OPT_VIO,
+	OPT_CTL,
+	OPT_NO_PUNT,
+	OPT_IOPRIO,
+};
+
+static void parse_args(int argc, char **argv)
+{
+	static const struct option lopts[] = {
+		{ "dev",       required_argument, NULL, 'd' },
+		{ "threads",   required_argument, NULL, 't' },
+		{ "depth",     required_argument, NULL, 'q' },
+		{ "batch",     required_argument, NULL, 'B' },
+		{ "bs",        required_argument, NULL, 'b' },
+		{ "read",      required_argument, NULL, 'r' },
+		{ "pattern",   required_argument, NULL, 'p' },
+		{ "runtime",   required_argument, NULL, 'T' },
+		{ "cpus",      required_argument, NULL, 'c' },
+		{ "offset",    required_argument, NULL, 'o' },
+		{ "size",      required_argument, NULL, 's' },
+		{ "sqpoll",    no_argument,       NULL, 'S' },
+		{ "iopoll",    no_argument,       NULL, 'P' },
+		{ "no-fixed",  no_argument,       NULL, 'N' },
+		{ "sweep",     no_argument,       NULL, OPT_SWEEP },
+		{ "step",      required_argument, NULL, OPT_STEP },
+		{ "placement", required_argument, NULL, OPT_PLACEMENT },
+		{ "stats",     required_argument, NULL, OPT_STATS },
+		{ "vio",       required_argument, NULL, OPT_VIO },
+		{ "ctl",       required_argument, NULL, OPT_CTL },
+		{ "no-punt",   no_argument,       NULL, OPT_NO_PUNT },
+		{ "ioprio",    required_argument, NULL, OPT_IOPRIO },
+		{ "help",      no_argument,       NULL, 'h' },
+		{ 0 }
+	};
+	int c;
+
+	parse_bs("4k");
+	while ((c = getopt_long(argc, argv, "d:t:q:B:b:r:p:T:c:o:s:SPNh",
+	                        lopts, NULL)) != -1) {
+		switch (c) {
+		case 'd': opts.dev = optarg; break;
+		case 't': opts.threads = strtoul(optarg, NULL, 0); break;
+		case 'q': opts.depth = strtoul(optarg, NULL, 0); break;
+		case 'B': opts.batch = strtoul(optarg, NULL, 0); break;
+		case 'r': opts.read_pct = strtoul(optarg, NULL, 0); break;
+		case 'p': opts.random = strcmp(optarg, "seq"); break;
+		case 'T': opts.runtime = strtoul(optarg, NULL, 0); break;
+		case 'o': opts.offset = parse_size(optarg); break;
+		case 's': opts.size = parse_size(optarg); break;
+		case 'S': opts.sqpoll = 1; break;
+		case 'P': opts.iopoll = 1; break;
+		case 'N': opts.fixed = 0; break;
+		case OPT_SWEEP: opts.sweep = 1; break;
+		case OPT_STEP: opts.sweep_step = strtoul(optarg, NULL, 0); break;
+		case OPT_PLACEMENT: opts.scatter = !strcmp(optarg, "scatter"); break;
+		case OPT_STATS: opts.stat_dir = optarg; break;
+		case OPT_VIO: opts.vio = strtoul(optarg, NULL, 0); break;
+		case OPT_CTL: opts.ctl = optarg; break;
+		case OPT_NO_PUNT: opts.no_punt = 1; break;
+		case 'b':
+			if (parse_bs(optarg)) {
+				fprintf(stderr, "bad block size spec '%s'\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'c':
+			if (parse_cpus(optarg)) {
+				fprintf(stderr, "bad cpu list '%s'\n", optarg);
+				exit(1);
+			}
+			break;
+		case OPT_IOPRIO:
+			if (parse_ioprio(optarg)) {
+				fprintf(stderr, "bad ioprio list '%s'\n", optarg);
+				exit(1);
+			}
+			break;
+		default:
+			usage(argv[0]);
+			exit(c == 'h' ? 0 : 1);
+		}
+	}
+
+	if (!opts.threads || !opts.depth || opts.read_pct > 100 ||
+	    opts.batch > opts.depth || !opts.sweep_step ||
+	    opts.vio > SBDD_VIO_MAX_VECS || (opts.vio && opts.iopoll) ||
+	    (opts.vio && opts.nr_ioprio)) {
+		usage(argv[0]);
+		exit(1);
+	}
+}
+
+static int probe_size(void)
+{
+	static char stat_dir[512];
+	struct stat st;
+	int fd = open(opts.dev, O_RDONLY);
+
+	if (fd < 0 || fstat(fd, &st)) {
+		perror(opts.dev);
+		return -1;
+	}
+
+	if (S_ISBLK(st.st_mode)) {
+		if (ioctl(fd, BLKGETSIZE64, &dev_size)) {
+			perror("BLKGETSIZE64");
+			close(fd);
+			return -1;
+		}
+		if (!opts.stat_dir) {
+			snprintf(stat_dir, sizeof(stat_dir),
+			         "/sys/dev/block/%u:%u/sbdd",
+			         major(st.st_rdev), minor(st.st_rdev));
+			opts.stat_dir = stat_dir;
+		}
+	} else {
+		dev_size = st.st_size;
+	}
+	close(fd);
+
+	if (opts.offset >= dev_size)
+		return -1;
+	if (!opts.size || opts.offset + opts.size > dev_size)
+		opts.size = dev_size - opts.offset;
+	if (opts.size < (unsigned long long)opts.bs_max * opts.threads)
+		return -1;
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct result *res;
+	unsigned int i;
+
+	parse_args(argc, argv);
+	if (opts.sweep && !opts.nr_cpus)
+		free(build_cpu_order());
+	if (opts.sweep)
+		opts.threads = opts.nr_cpus;
+
+	if (probe_size()) {
+		fprintf(stderr, "%s: size or offset out of range\n", opts.dev);
+		return 1;
+	}
+
+	fprintf(opts.sweep ? stderr : stdout,
+	        "dev=%s size=%llu threads=%u depth=%u batch=%u pattern=%s "
+	        "read=%u%% sqpoll=%d iopoll=%d fixed=%d\n", opts.dev, opts.size,
+	        opts.threads, opts.depth, opts.batch, opts.random ? "rand" : "seq",
+	        opts.read_pct, opts.sqpoll, opts.iopoll, opts.fixed);
+
+	if (opts.sweep)
+		return run_sweep();
+
+	res = malloc(sizeof(*res));
+	if (!res)
+		return 1;
+
+	run_round(opts.threads, res);
+	if (res->secs) {
+		print_line("read", res->ios[0], res->bytes[0], &res->hist[0], res->secs);
+		print_line("write", res->ios[1], res->bytes[1], &res->hist[1], res->secs);
+		print_line("total", res->ios[0] + res->ios[1],
+		           res->bytes[0] + res->bytes[1], &res->hist[2], res->secs);
+		for (i = 0; i < NR_CLASSES; i++)
+			print_line(class_names[i], res->cls_ios[i], res->cls_bytes[i],
+			           &res->cls_hist[i], res->secs);
+	}
+	printf("io-wq workers: %u\n", res->iowq);
+
+	if (opts.no_punt && res->iowq) {
+		fprintf(stderr, "I/O was punted to io-wq\n");
+		return 1;
+	}
+
+	return res->err ? 1 : 0;
+}
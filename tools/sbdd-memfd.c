@@ -0,0 +1,133 @@
+/*
+sbdd-memfd: hands a memfd to sbdd loaded with store=memfd.
+
+Creates a memfd of the given size, seals it against shrinking, attaches it
+through /dev/sbdd-ctl and optionally fills it from a file through its own
+mapping, which is how a producer publishes data without writing it through
+the block device. sbdd keeps its own reference to the memfd, so the disk
+stays valid after this process exits.
+*/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+
+#include "../sbdd.h"
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s -s size[k|m|g] [-f fill_file] [-C ctl_dev]\n",
+		prog);
+	exit(1);
+}
+
+static uint64_t parse_size(const char *s)
+{
+	char *end;
+	uint64_t v = strtoull(s, &end, 0);
+
+	switch (*end) {
+	case 'g': case 'G': v <<= 10; /* fallthrough */
+	case 'm': case 'M': v <<= 10; /* fallthrough */
+	case 'k': case 'K': v <<= 10; break;
+	default: break;
+	}
+
+	return v;
+}
+
+/* Copies the file into the mapping with plain reads, no O_DIRECT needed */
+static int fill(void *map, uint64_t size, const char *path)
+{
+	uint64_t off = 0;
+	ssize_t ret;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		return -1;
+	}
+
+	while (off < size) {
+		ret = read(fd, (char *)map + off, size - off);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("read");
+			close(fd);
+			return -1;
+		}
+		if (!ret)
+			break;
+		off += ret;
+	}
+
+	close(fd);
+	printf("filled %llu bytes from %s\n", (unsigned long long)off, path);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	const char *ctl = "/dev/" SBDD_CTL_NAME;
+	struct sbdd_attach attach = { 0 };
+	const char *path = NULL;
+	uint64_t size = 0;
+	void *map;
+	int memfd, ctlfd;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:f:C:h")) != -1) {
+		switch (opt) {
+		case 's': size = parse_size(optarg); break;
+		case 'f': path = optarg; break;
+		case 'C': ctl = optarg; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (!size)
+		usage(argv[0]);
+
+	memfd = memfd_create("sbdd", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (memfd < 0) {
+		perror("memfd_create");
+		return 1;
+	}
+
+	if (ftruncate(memfd, size) || fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_SEAL)) {
+		perror("memfd setup");
+		return 1;
+	}
+
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	if (path && fill(map, size, path))
+		return 1;
+
+	ctlfd = open(ctl, O_RDWR | O_CLOEXEC);
+	if (ctlfd < 0) {
+		perror(ctl);
+		return 1;
+	}
+
+	attach.memfd = memfd;
+	if (ioctl(ctlfd, SBDD_IOC_ATTACH_MEMFD, &attach)) {
+		perror("SBDD_IOC_ATTACH_MEMFD");
+		return 1;
+	}
+
+	printf("attached %llu bytes\n", (unsigned long long)attach.size);
+	return 0;
+}
@@ -0,0 +1,151 @@
+/*
+sbdd-scan: checksums the whole sbdd device and reports the scan bandwidth.
+
+By default the device contents are mapped from /dev/sbdd-mem and summed in
+place. With -r the same sum is computed from O_DIRECT read()s of the block
+device, which is the copy the mapping saves; comparing both shows what a
+scanner gains from it.
+*/
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include "../sbdd.h"
+
+#define READ_BS                 (4U << 20)
+
+/* Fletcher-like sum, cheap enough to stay memory bound */
+static void sum(const uint64_t *p, size_t n, uint64_t *a, uint64_t *b)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		*a += p[i];
+		*b += *a;
+	}
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t dev_size(const char *dev)
+{
+	uint64_t size = 0;
+	int fd = open(dev, O_RDONLY);
+
+	if (fd < 0 || ioctl(fd, BLKGETSIZE64, &size))
+		perror(dev);
+	if (fd >= 0)
+		close(fd);
+
+	return size;
+}
+
+static int scan_mmap(const char *mem, uint64_t size, uint64_t *a, uint64_t *b)
+{
+	void *map;
+	int fd;
+
+	fd = open(mem, O_RDONLY);
+	if (fd < 0) {
+		perror(mem);
+		return -1;
+	}
+
+	map = mmap(NULL, size, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+
+	madvise(map, size, MADV_SEQUENTIAL);
+	sum(map, size / 8, a, b);
+	munmap(map, size);
+	return 0;
+}
+
+static int scan_read(const char *dev, uint64_t size, uint64_t *a, uint64_t *b)
+{
+	uint64_t off;
+	ssize_t ret;
+	void *buf;
+	int fd;
+
+	fd = open(dev, O_RDONLY | O_DIRECT);
+	if (fd < 0) {
+		perror(dev);
+		return -1;
+	}
+
+	if (posix_memalign(&buf, 4096, READ_BS)) {
+		close(fd);
+		return -1;
+	}
+
+	for (off = 0; off < size; off += ret) {
+		ret = pread(fd, buf, READ_BS, off);
+		if (ret <= 0) {
+			perror("pread");
+			break;
+		}
+		sum(buf, ret / 8, a, b);
+	}
+
+	free(buf);
+	close(fd);
+	return off < size ? -1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+	const char *mem = "/dev/" SBDD_MEM_NAME;
+	const char *dev = "/dev/sbdd";
+	uint64_t size, a = 0, b = 0;
+	int use_read = 0;
+	double t;
+	int opt;
+	int ret;
+
+	while ((opt = getopt(argc, argv, "d:m:rh")) != -1) {
+		switch (opt) {
+		case 'd': dev = optarg; break;
+		case 'm': mem = optarg; break;
+		case 'r': use_read = 1; break;
+		default:
+			fprintf(stderr, "usage: %s [-d blockdev] [-m memdev] [-r]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+
+	size = dev_size(dev);
+	if (!size)
+		return 1;
+
+	t = now();
+	ret = use_read ? scan_read(dev, size, &a, &b) :
+			 scan_mmap(mem, size, &a, &b);
+	t = now() - t;
+	if (ret)
+		return 1;
+
+	printf("%s: %llu MiB in %.3f s, %.0f MiB/s, sum %016llx%016llx\n",
+	       use_read ? "read" : "mmap", (unsigned long long)(size >> 20), t,
+	       (size >> 20) / t, (unsigned long long)b, (unsigned long long)a);
+	return 0;
+}
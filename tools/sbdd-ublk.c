@@ -0,0 +1,556 @@
+/*
+sbdd-ublk: the sbdd store served from user space through ublk.
+
+Where sbdd.ko cannot be loaded, ublk_drv (in tree since 6.0) exposes a
+block device whose requests are handed to this process over io_uring. The
+store has sbdd's semantics: a zeroed RAM buffer of the given capacity,
+read/write, and with -z discard and write zeroes, which give the memory
+back to the system. The result is /dev/ublkbN, which sbdd-load and the
+scripts in this directory can drive exactly like /dev/sbdd.
+
+Every queue runs in its own thread, pinned to the queue's CPUs, with its own
+ring. A thread waits for at least one request, handles every completion
+that arrived meanwhile and commits all results and refetches with one
+io_uring_enter(). By default ublk copies request data to a per-tag buffer
+and this process copies it to the store again; with -u (UBLK_F_USER_COPY)
+request data moves between the request pages and the store with a single
+pread()/pwrite() on the ublk char device.
+
+With -U the device is added as UBLK_F_UNPRIVILEGED_DEV, so that a user
+with access to /dev/ublk-control can run it without CAP_SYS_ADMIN.
+*/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <linux/ublk_cmd.h>
+
+#include "uring.h"
+
+/* Newer uapi than some distro headers carry */
+#ifndef UBLK_F_UNPRIVILEGED_DEV
+#define UBLK_F_UNPRIVILEGED_DEV (1ULL << 5)
+#endif
+#ifndef UBLK_F_CMD_IOCTL_ENCODE
+#define UBLK_F_CMD_IOCTL_ENCODE (1ULL << 6)
+#endif
+#ifndef UBLK_F_USER_COPY
+#define UBLK_F_USER_COPY        (1ULL << 7)
+#endif
+#ifndef UBLK_U_CMD_ADD_DEV
+#define UBLK_U_CMD_GET_QUEUE_AFFINITY _IOR('u', UBLK_CMD_GET_QUEUE_AFFINITY, struct ublksrv_ctrl_cmd)
+#define UBLK_U_CMD_ADD_DEV      _IOWR('u', UBLK_CMD_ADD_DEV, struct ublksrv_ctrl_cmd)
+#define UBLK_U_CMD_DEL_DEV      _IOWR('u', UBLK_CMD_DEL_DEV, struct ublksrv_ctrl_cmd)
+#define UBLK_U_CMD_START_DEV    _IOWR('u', UBLK_CMD_START_DEV, struct ublksrv_ctrl_cmd)
+#define UBLK_U_CMD_STOP_DEV     _IOWR('u', UBLK_CMD_STOP_DEV, struct ublksrv_ctrl_cmd)
+#define UBLK_U_CMD_SET_PARAMS   _IOWR('u', UBLK_CMD_SET_PARAMS, struct ublksrv_ctrl_cmd)
+#define UBLK_U_IO_FETCH_REQ     _IOWR('u', UBLK_IO_FETCH_REQ, struct ublksrv_io_cmd)
+#define UBLK_U_IO_COMMIT_AND_FETCH_REQ _IOWR('u', UBLK_IO_COMMIT_AND_FETCH_REQ, struct ublksrv_io_cmd)
+#endif
+#ifndef UBLK_TAG_OFF
+#define UBLK_TAG_OFF            25
+#define UBLK_QID_OFF            (UBLK_TAG_OFF + 16)
+#endif
+
+#define CTRL_DEV                "/dev/ublk-control"
+#define SECTOR_SHIFT            9
+#define PAGE_SZ                 4096UL
+#define MAX_QUEUES              64
+#define MAX_IO_BYTES            (512U << 10)
+
+/*
+struct ublksrv_ctrl_cmd as of 6.5: data[1] became dev_path_len, which
+unprivileged devices need for every command but ADD_DEV.
+*/
+struct ctrl_cmd {
+	__u32                   dev_id;
+	__u16                   queue_id;
+	__u16                   len;
+	__u64                   addr;
+	__u64                   data;
+	__u16                   dev_path_len;
+	__u16                   pad;
+	__u32                   reserved;
+};
+
+struct options {
+	uint64_t                capacity;
+	unsigned int            nr_queues;
+	unsigned int            depth;
+	int                     dev_id;
+	int                     discard;
+	int                     user_copy;
+	int                     unprivileged;
+};
+
+struct queue {
+	unsigned int            id;
+	pthread_t               thread;
+	struct uring            ring;
+	struct ublksrv_io_desc  *iods;
+	size_t                  iods_sz;
+	char                    *bufs;
+	cpu_set_t               cpus;
+	unsigned int            inflight;
+	int                     stopping;
+};
+
+static struct options opt = {
+	.capacity = 100ULL << 20,
+	.nr_queues = 1,
+	.depth = 128,
+	.dev_id = -1,
+};
+
+static struct uring ctrl_ring;
+static struct ublksrv_ctrl_dev_info info;
+static struct queue queues[MAX_QUEUES];
+static char cdev_path[64];
+static char *store;
+static int ctrl_fd = -1;
+static int cdev_fd = -1;
+
+/*
+START_DEV waits until every tag of every queue is fetched, so the queues
+report their setup to main first and fetch only once main saw all of them
+succeed. On any failure they exit instead and main stops the device.
+*/
+static pthread_mutex_t setup_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t setup_cond = PTHREAD_COND_INITIALIZER;
+static unsigned int setup_ready;
+static int setup_failed;
+static int setup_done;
+
+static int ctrl_cmd(unsigned int op, __u16 queue_id, void *buf, __u16 len,
+		    __u64 data)
+{
+	char pathbuf[sizeof(cdev_path) + 4096];
+	struct ctrl_cmd cmd = {
+		.dev_id = info.dev_id,
+		.queue_id = queue_id,
+		.len = len,
+		.addr = (__u64)(uintptr_t)buf,
+		.data = data,
+	};
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	int ret;
+
+	/* Unprivileged devices prove ownership with the char device path */
+	if (opt.unprivileged && op != UBLK_U_CMD_ADD_DEV) {
+		size_t plen = strlen(cdev_path);
+
+		if (len > sizeof(pathbuf) - plen)
+			return -EINVAL;
+		memcpy(pathbuf, cdev_path, plen);
+		if (len)
+			memcpy(pathbuf + plen, buf, len);
+		cmd.addr = (__u64)(uintptr_t)pathbuf;
+		cmd.len = plen + len;
+		cmd.dev_path_len = plen;
+	}
+
+	sqe = uring_get_sqe(&ctrl_ring);
+	sqe->opcode = IORING_OP_URING_CMD;
+	sqe->fd = ctrl_fd;
+	sqe->cmd_op = op;
+	memcpy(sqe->cmd, &cmd, sizeof(cmd));
+
+	ret = uring_submit(&ctrl_ring, 1);
+	if (ret < 0)
+		return ret;
+
+	cqe = uring_peek_cqe(&ctrl_ring);
+	if (!cqe)
+		return -EIO;
+	ret = cqe->res;
+	uring_cqe_seen(&ctrl_ring);
+
+	/* GET_QUEUE_AFFINITY returned its data behind the path */
+	if (ret >= 0 && cmd.addr != (__u64)(uintptr_t)buf && len)
+		memcpy(buf, pathbuf + cmd.dev_path_len, len);
+
+	return ret;
+}
+
+static int add_dev(void)
+{
+	struct ublk_params params = { 0 };
+	int ret;
+
+	info.nr_hw_queues = opt.nr_queues;
+	info.queue_depth = opt.depth;
+	info.max_io_buf_bytes = MAX_IO_BYTES;
+	info.dev_id = opt.dev_id;
+	info.ublksrv_pid = getpid();
+	info.flags = UBLK_F_CMD_IOCTL_ENCODE;
+	if (opt.user_copy)
+		info.flags |= UBLK_F_USER_COPY;
+	if (opt.unprivileged)
+		info.flags |= UBLK_F_UNPRIVILEGED_DEV;
+
+	ret = ctrl_cmd(UBLK_U_CMD_ADD_DEV, (__u16)-1, &info, sizeof(info), 0);
+	if (ret < 0) {
+		fprintf(stderr, "ADD_DEV: %s\n", strerror(-ret));
+		return ret;
+	}
+	snprintf(cdev_path, sizeof(cdev_path), "/dev/ublkc%u", info.dev_id);
+
+	params.len = sizeof(params);
+	params.types = UBLK_PARAM_TYPE_BASIC;
+	params.basic.logical_bs_shift = SECTOR_SHIFT;
+	params.basic.physical_bs_shift = 12;
+	params.basic.io_min_shift = SECTOR_SHIFT;
+	params.basic.io_opt_shift = 12;
+	params.basic.max_sectors = MAX_IO_BYTES >> SECTOR_SHIFT;
+	params.basic.dev_sectors = opt.capacity >> SECTOR_SHIFT;
+	if (opt.discard) {
+		params.types |= UBLK_PARAM_TYPE_DISCARD;
+		params.discard.discard_granularity = PAGE_SZ;
+		params.discard.max_discard_sectors = UINT32_MAX >> SECTOR_SHIFT;
+		params.discard.max_write_zeroes_sectors = UINT32_MAX >> SECTOR_SHIFT;
+		params.discard.max_discard_segments = 1;
+	}
+
+	ret = ctrl_cmd(UBLK_U_CMD_SET_PARAMS, (__u16)-1, &params,
+		       sizeof(params), 0);
+	if (ret < 0)
+		fprintf(stderr, "SET_PARAMS: %s\n", strerror(-ret));
+
+	return ret;
+}
+
+/* Whole pages are dropped, reads of them see fresh zero pages again */
+static void zero_range(uint64_t off, uint64_t len)
+{
+	uint64_t start = (off + PAGE_SZ - 1) & ~(PAGE_SZ - 1);
+	uint64_t end = (off + len) & ~(PAGE_SZ - 1);
+
+	if (start >= end) {
+		memset(store + off, 0, len);
+		return;
+	}
+
+	memset(store + off, 0, start - off);
+	madvise(store + start, end - start, MADV_DONTNEED);
+	memset(store + end, 0, off + len - end);
+}
+
+static int handle_io(struct queue *q, unsigned int tag)
+{
+	const struct ublksrv_io_desc *iod = &q->iods[tag];
+	uint64_t off = iod->start_sector << SECTOR_SHIFT;
+	uint64_t len = (uint64_t)iod->nr_sectors << SECTOR_SHIFT;
+	char *buf = q->bufs + (size_t)tag * MAX_IO_BYTES;
+	off_t pos = UBLKSRV_IO_BUF_OFFSET +
+		    ((off_t)q->id << UBLK_QID_OFF) + ((off_t)tag << UBLK_TAG_OFF);
+	ssize_t ret;
+
+	if (off + len > opt.capacity)
+		return -EIO;
+
+	switch (ublksrv_get_op(iod)) {
+	case UBLK_IO_OP_READ:
+		if (!opt.user_copy) {
+			memcpy(buf, store + off, len);
+			return len;
+		}
+		ret = pwrite(cdev_fd, store + off, len, pos);
+		return ret < 0 ? -errno : ret;
+	case UBLK_IO_OP_WRITE:
+		if (!opt.user_copy) {
+			memcpy(store + off, buf, len);
+			return len;
+		}
+		ret = pread(cdev_fd, store + off, len, pos);
+		return ret < 0 ? -errno : ret;
+	case UBLK_IO_OP_FLUSH:
+		return 0;
+	case UBLK_IO_OP_DISCARD:
+	case UBLK_IO_OP_WRITE_ZEROES:
+		if (!opt.discard)
+			return -EOPNOTSUPP;
+		zero_range(off, len);
+		return 0;
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static void queue_cmd(struct queue *q, unsigned int op, unsigned int tag,
+		      int result)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(&q->ring);
+	struct ublksrv_io_cmd *cmd = (struct ublksrv_io_cmd *)&sqe->addr3;
+
+	sqe->opcode = IORING_OP_URING_CMD;
+	sqe->fd = 0;
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->cmd_op = op;
+	sqe->user_data = tag;
+
+	cmd->q_id = q->id;
+	cmd->tag = tag;
+	cmd->result = result;
+	cmd->addr = opt.user_copy ? 0 :
+		    (__u64)(uintptr_t)(q->bufs + (size_t)tag * MAX_IO_BYTES);
+	q->inflight++;
+}
+
+static void *queue_thread(void *arg)
+{
+	struct queue *q = arg;
+	struct io_uring_params p = { 0 };
+	struct io_uring_cqe *cqe;
+	unsigned int tag;
+	int ret, failed;
+
+	if (CPU_COUNT(&q->cpus))
+		pthread_setaffinity_np(pthread_self(), sizeof(q->cpus), &q->cpus);
+
+	/* The ring holds every tag's command, completions never overflow */
+	ret = uring_init(&q->ring, opt.depth, &p);
+	if (!ret) {
+		ret = uring_register(&q->ring, IORING_REGISTER_FILES, &cdev_fd, 1);
+		if (ret)
+			uring_exit(&q->ring);
+	}
+	if (ret)
+		fprintf(stderr, "queue %u: ring setup: %s\n", q->id, strerror(-ret));
+
+	pthread_mutex_lock(&setup_lock);
+	setup_ready++;
+	if (ret)
+		setup_failed = 1;
+	pthread_cond_broadcast(&setup_cond);
+	while (!setup_done)
+		pthread_cond_wait(&setup_cond, &setup_lock);
+	failed = setup_failed;
+	pthread_mutex_unlock(&setup_lock);
+
+	if (failed) {
+		if (!ret)
+			uring_exit(&q->ring);
+		return NULL;
+	}
+
+	for (tag = 0; tag < opt.depth; tag++)
+		queue_cmd(q, UBLK_U_IO_FETCH_REQ, tag, -1);
+
+	while (q->inflight) {
+		ret = uring_submit(&q->ring, 1);
+		if (ret < 0) {
+			fprintf(stderr, "queue %u: submit: %s\n", q->id,
+				strerror(-ret));
+			break;
+		}
+
+		/* Everything that completed meanwhile goes back in one enter */
+		while ((cqe = uring_peek_cqe(&q->ring))) {
+			tag = cqe->user_data;
+			ret = cqe->res;
+			uring_cqe_seen(&q->ring);
+			q->inflight--;
+
+			if (ret == UBLK_IO_RES_ABORT || q->stopping) {
+				q->stopping = 1;
+				continue;
+			}
+			if (ret != UBLK_IO_RES_OK) {
+				fprintf(stderr, "queue %u tag %u: %s\n", q->id, tag,
+					strerror(-ret));
+				q->stopping = 1;
+				continue;
+			}
+
+			queue_cmd(q, UBLK_U_IO_COMMIT_AND_FETCH_REQ, tag,
+				  handle_io(q, tag));
+		}
+	}
+
+	uring_exit(&q->ring);
+	return NULL;
+}
+
+static int queue_setup(struct queue *q, unsigned int id)
+{
+	size_t max_sz = (UBLK_MAX_QUEUE_DEPTH * sizeof(struct ublksrv_io_desc) +
+			 PAGE_SZ - 1) & ~(PAGE_SZ - 1);
+	int ret;
+
+	q->id = id;
+	q->iods_sz = (opt.depth * sizeof(struct ublksrv_io_desc) + PAGE_SZ - 1) &
+		     ~(PAGE_SZ - 1);
+	q->iods = mmap(NULL, q->iods_sz, PROT_READ, MAP_SHARED | MAP_POPULATE,
+		       cdev_fd, UBLKSRV_CMD_BUF_OFFSET + id * max_sz);
+	if (q->iods == MAP_FAILED) {
+		perror("mmap io descriptors");
+		return -1;
+	}
+
+	/* One contiguous buffer area per queue, sliced per tag */
+	if (!opt.user_copy) {
+		q->bufs = mmap(NULL, (size_t)opt.depth * MAX_IO_BYTES,
+			       PROT_READ | PROT_WRITE,
+			       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (q->bufs == MAP_FAILED) {
+			perror("mmap buffers");
+			return -1;
+		}
+	}
+
+	ret = ctrl_cmd(UBLK_U_CMD_GET_QUEUE_AFFINITY, id, &q->cpus,
+		       sizeof(q->cpus), 0);
+	if (ret < 0)
+		CPU_ZERO(&q->cpus);
+
+	return pthread_create(&q->thread, NULL, queue_thread, q) ? -1 : 0;
+}
+
+static uint64_t parse_size(const char *s)
+{
+	char *end;
+	uint64_t v = strtoull(s, &end, 0);
+
+	switch (*end) {
+	case 'g': case 'G': v <<= 10; /* fallthrough */
+	case 'm': case 'M': v <<= 10; /* fallthrough */
+	case 'k': case 'K': v <<= 10; break;
+	default: break;
+	}
+
+	return v;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-s size] [-q queues] [-d depth] [-n dev_id] [-z] [-u] [-U]\n"
+		"  -s  capacity, k/m/g suffixes (default 100m)\n"
+		"  -q  hardware queues (default 1)\n"
+		"  -d  queue depth (default 128)\n"
+		"  -n  ublk device id (default: first free)\n"
+		"  -z  support discard and write zeroes\n"
+		"  -u  UBLK_F_USER_COPY, one copy per request\n"
+		"  -U  unprivileged device\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct io_uring_params p = { .flags = IORING_SETUP_SQE128 };
+	unsigned int i;
+	sigset_t sigs;
+	int ret, sig;
+	int c;
+
+	while ((c = getopt(argc, argv, "s:q:d:n:zuUh")) != -1) {
+		switch (c) {
+		case 's': opt.capacity = parse_size(optarg); break;
+		case 'q': opt.nr_queues = atoi(optarg); break;
+		case 'd': opt.depth = atoi(optarg); break;
+		case 'n': opt.dev_id = atoi(optarg); break;
+		case 'z': opt.discard = 1; break;
+		case 'u': opt.user_copy = 1; break;
+		case 'U': opt.unprivileged = 1; break;
+		default: usage(argv[0]);
+		}
+	}
+
+	opt.capacity &= ~((1ULL << SECTOR_SHIFT) - 1);
+	if (!opt.capacity || !opt.nr_queues || opt.nr_queues > MAX_QUEUES ||
+	    !opt.depth || opt.depth > UBLK_MAX_QUEUE_DEPTH)
+		usage(argv[0]);
+
+	/* Anonymous memory reads as zeroes until written, like sbdd's store */
+	store = mmap(NULL, opt.capacity, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (store == MAP_FAILED) {
+		perror("mmap store");
+		return 1;
+	}
+
+	/* Stopped by SIGINT/SIGTERM, handled synchronously below */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+	ctrl_fd = open(CTRL_DEV, O_RDWR);
+	if (ctrl_fd < 0) {
+		perror(CTRL_DEV);
+		return 1;
+	}
+
+	ret = uring_init(&ctrl_ring, 4, &p);
+	if (ret) {
+		fprintf(stderr, "control ring: %s\n", strerror(-ret));
+		return 1;
+	}
+
+	if (add_dev() < 0)
+		goto del;
+
+	cdev_fd = open(cdev_path, O_RDWR);
+	if (cdev_fd < 0) {
+		perror(cdev_path);
+		goto del;
+	}
+
+	for (i = 0; i < opt.nr_queues; i++)
+		if (queue_setup(&queues[i], i))
+			break;
+
+	/* Waits for the queues started so far, releases them all at once */
+	pthread_mutex_lock(&setup_lock);
+	while (setup_ready < i)
+		pthread_cond_wait(&setup_cond, &setup_lock);
+	if (i < opt.nr_queues)
+		setup_failed = 1;
+	ret = setup_failed;
+	setup_done = 1;
+	pthread_cond_broadcast(&setup_cond);
+	pthread_mutex_unlock(&setup_lock);
+	if (ret)
+		goto stop;
+
+	/* Returns once every queue has fetched all its tags */
+	ret = ctrl_cmd(UBLK_U_CMD_START_DEV, (__u16)-1, NULL, 0, getpid());
+	if (ret < 0) {
+		fprintf(stderr, "START_DEV: %s\n", strerror(-ret));
+		goto stop;
+	}
+
+	printf("/dev/ublkb%u: %llu MiB, %u queues, depth %u%s%s\n", info.dev_id,
+	       (unsigned long long)(opt.capacity >> 20), opt.nr_queues,
+	       opt.depth, opt.discard ? ", discard" : "",
+	       opt.user_copy ? ", user copy" : "");
+	fflush(stdout);
+
+	sigwait(&sigs, &sig);
+
+stop:
+	ctrl_cmd(UBLK_U_CMD_STOP_DEV, (__u16)-1, NULL, 0, 0);
+	for (i = 0; i < opt.nr_queues; i++)
+		if (queues[i].thread)
+			pthread_join(queues[i].thread, NULL);
+	if (cdev_fd >= 0)
+		close(cdev_fd);
+del:
+	if (cdev_path[0])
+		ctrl_cmd(UBLK_U_CMD_DEL_DEV, (__u16)-1, NULL, 0, 0);
+	uring_exit(&ctrl_ring);
+	close(ctrl_fd);
+	return 0;
+}
@@ -0,0 +1,100 @@
+#!/bin/sh
+# Unload-under-load stress for sbdd.
+#
+# Every iteration loads the module, starts parallel I/O and at a random point
+# deletes the disk through /dev/sbdd-ctl (sbdd-delete) while the loaders are
+# still submitting, so teardown races with bios in flight and drains
+# refs_cnt for real. The kernel prints how long that drain took, the script
+# collects it along with the wall time of the delete. The loaders are then
+# killed and the module removed as soon as the kernel allows it, so rmmod
+# races with the last block device release.
+#
+# rmmod alone cannot get there: an open disk pins the module, sbdd_delete()
+# only runs once every opener is gone and has nothing left to drain.
+#
+# Output is CSV on stdout: iter,io_ms,delete_us,drain_us,rmmod_wait_ms
+# Any BUG/WARNING/KASAN/lockdep splat in dmesg stops the run with exit code 1.
+
+set -u
+
+ITERS=${ITERS:-100}
+HERE=$(dirname "$0")
+MODULE=${MODULE:-$HERE/sbdd.ko}
+[ -f "$MODULE" ] || MODULE=$HERE/../sbdd.ko
+LOAD=${LOAD:-$HERE/sbdd-load}
+DELETE=${DELETE:-$HERE/sbdd-delete}
+DEV=${DEV:-/dev/sbdd}
+JOBS=${JOBS:-4}
+MODARGS=${MODARGS:-capacity_mib=64}
+MAX_IO_MS=${MAX_IO_MS:-500}
+
+usage() {
+	echo "usage: $0 [-n iters] [-m sbdd.ko] [-l sbdd-load] [-j jobs] [-a modargs]" >&2
+	exit 1
+}
+
+while getopts "n:m:l:j:a:h" opt; do
+	case $opt in
+	n) ITERS=$OPTARG ;;
+	m) MODULE=$OPTARG ;;
+	l) LOAD=$OPTARG ;;
+	j) JOBS=$OPTARG ;;
+	a) MODARGS=$OPTARG ;;
+	*) usage ;;
+	esac
+done
+
+now_ms() {
+	echo $(( $(date +%s%N) / 1000000 ))
+}
+
+rand() {
+	echo $(( $(od -An -N2 -tu2 /dev/urandom) % $1 ))
+}
+
+check_dmesg() {
+	if dmesg | grep -E -q "BUG:|WARNING:|KASAN|possible circular locking|inconsistent lock state|general protection"; then
+		dmesg | tail -n 100 >&2
+		echo "kernel splat after iteration $1" >&2
+		exit 1
+	fi
+}
+
+lsmod | grep -q "^sbdd " && rmmod sbdd
+dmesg -C
+echo "iter,io_ms,delete_us,drain_us,rmmod_wait_ms"
+
+i=0
+while [ "$i" -lt "$ITERS" ]; do
+	insmod "$MODULE" $MODARGS || exit 1
+	while [ ! -b "$DEV" ]; do sleep 0.01; done
+
+	pids=""
+	j=0
+	while [ "$j" -lt "$JOBS" ]; do
+		"$LOAD" -d "$DEV" -t 2 -q 64 -b 4k/50:128k/30:1m/20 -r 50 -T 60 \
+			>/dev/null 2>&1 &
+		pids="$pids $!"
+		j=$((j + 1))
+	done
+
+	io_ms=$(rand "$MAX_IO_MS")
+	sleep "$(echo "$io_ms" | awk '{ printf "%.3f", $1 / 1000 }')"
+
+	# The loaders keep the disk open and bios in flight meanwhile
+	delete_us=$("$DELETE" | sed -n 's/^deleted in \([0-9]*\) us$/\1/p')
+	kill -9 $pids 2>/dev/null
+
+	# Spin on rmmod so it lands right after the last opener goes away
+	start=$(now_ms)
+	until rmmod sbdd 2>/dev/null; do :; done
+	wait_ms=$(( $(now_ms) - start ))
+	wait $pids 2>/dev/null
+
+	drain_us=$(dmesg | sed -n 's/.*sbdd: drained in \([0-9]*\) us.*/\1/p' | tail -n 1)
+	echo "$i,$io_ms,${delete_us:-},${drain_us:-},$wait_ms"
+
+	check_dmesg "$i"
+	dmesg -C
+	i=$((i + 1))
+done
@@ -0,0 +1,61 @@
+#!/bin/sh
+# Teardown time of the vmalloc store against capacity.
+#
+# For every capacity the module is loaded, the whole device is written once
+# so that no page is left untouched, and the module is removed. sbdd_delete()
+# prints how long handing the store segments to kvfree_rcu() took, the script
+# collects that, the wall time of rmmod and how long after rmmod MemFree gets
+# back within SLACK_MIB of its value before the load, as the memory is given
+# back in the background.
+#
+# Output is CSV on stdout: capacity_mib,insmod_ms,rmmod_ms,free_us,release_ms
+
+set -u
+
+HERE=$(dirname "$0")
+MODULE=${MODULE:-$HERE/sbdd.ko}
+[ -f "$MODULE" ] || MODULE=$HERE/../sbdd.ko
+DEV=${DEV:-/dev/sbdd}
+CAPACITIES=${CAPACITIES:-"1024 4096 16384 65536"}
+MODARGS=${MODARGS:-}
+SLACK_MIB=${SLACK_MIB:-256}
+
+now_ms() {
+	echo $(($(date +%s%N) / 1000000))
+}
+
+mem_free_mib() {
+	awk '/^MemFree:/ { print int($2 / 1024) }' /proc/meminfo
+}
+
+echo "capacity_mib,insmod_ms,rmmod_ms,free_us,release_ms"
+
+for mib in $CAPACITIES; do
+	sync
+	echo 3 > /proc/sys/vm/drop_caches
+	before=$(mem_free_mib)
+	t0=$(now_ms)
+	insmod "$MODULE" capacity_mib="$mib" $MODARGS || exit 1
+	t1=$(now_ms)
+
+	udevadm settle
+	dd if=/dev/zero of="$DEV" bs=4M oflag=direct status=none
+
+	dmesg -C
+	t2=$(now_ms)
+	rmmod sbdd || exit 1
+	t3=$(now_ms)
+
+	# Gives up after a minute and leaves the column empty
+	release_ms=
+	while [ $(($(now_ms) - t3)) -lt 60000 ]; do
+		if [ $(($(mem_free_mib) + SLACK_MIB)) -ge "$before" ]; then
+			release_ms=$(($(now_ms) - t3))
+			break
+		fi
+		sleep 0.01
+	done
+
+	free_us=$(dmesg | sed -n 's/.*released [0-9]* segments in \([0-9]*\) us.*/\1/p')
+	echo "$mib,$((t1 - t0)),$((t3 - t2)),${free_us:-},$release_ms"
+done
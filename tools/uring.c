@@ -0,0 +1,157 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit,
+                              unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+	               NULL, 0);
+}
+
+int uring_init(struct uring *r, unsigned int entries, struct io_uring_params *p)
+{
+	unsigned int i;
+
+	memset(r, 0, sizeof(*r));
+
+	r->fd = sys_io_uring_setup(entries, p);
+	if (r->fd < 0)
+		return -errno;
+
+	r->flags = p->flags;
+	r->sqe_shift = (p->flags & IORING_SETUP_SQE128) ? 1 : 0;
+
+	r->sq_ring_sz = p->sq_off.array + p->sq_entries * sizeof(unsigned int);
+	r->cq_ring_sz = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_ring_sz > r->sq_ring_sz)
+			r->sq_ring_sz = r->cq_ring_sz;
+		r->cq_ring_sz = r->sq_ring_sz;
+	}
+
+	r->sq_ring = mmap(NULL, r->sq_ring_sz, PROT_READ | PROT_WRITE,
+	                  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ring == MAP_FAILED)
+		goto fail;
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		r->cq_ring = r->sq_ring;
+	} else {
+		r->cq_ring = mmap(NULL, r->cq_ring_sz, PROT_READ | PROT_WRITE,
+		                  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if (r->cq_ring == MAP_FAILED) {
+			r->cq_ring = NULL;
+			goto fail;
+		}
+	}
+
+	r->sqes_sz = (p->sq_entries * sizeof(struct io_uring_sqe)) << r->sqe_shift;
+	r->sqes = mmap(NULL, r->sqes_sz, PROT_READ | PROT_WRITE,
+	               MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) {
+		r->sqes = NULL;
+		goto fail;
+	}
+
+	r->sq_head = r->sq_ring + p->sq_off.head;
+	r->sq_tail = r->sq_ring + p->sq_off.tail;
+	r->sq_mask = r->sq_ring + p->sq_off.ring_mask;
+	r->sq_flags = r->sq_ring + p->sq_off.flags;
+	r->sq_array = r->sq_ring + p->sq_off.array;
+	r->cq_head = r->cq_ring + p->cq_off.head;
+	r->cq_tail = r->cq_ring + p->cq_off.tail;
+	r->cq_mask = r->cq_ring + p->cq_off.ring_mask;
+	r->cqes = r->cq_ring + p->cq_off.cqes;
+
+	/* SQ array is an identity map, SQEs are consumed in order */
+	for (i = 0; i < p->sq_entries; i++)
+		r->sq_array[i] = i;
+
+	r->sqe_tail = *r->sq_tail;
+	return 0;
+
+fail:
+	i = errno;
+	uring_exit(r);
+	return -i;
+}
+
+void uring_exit(struct uring *r)
+{
+	if (r->sqes)
+		munmap(r->sqes, r->sqes_sz);
+	if (r->cq_ring && r->cq_ring != r->sq_ring)
+		munmap(r->cq_ring, r->cq_ring_sz);
+	if (r->sq_ring && r->sq_ring != MAP_FAILED)
+		munmap(r->sq_ring, r->sq_ring_sz);
+	if (r->fd >= 0)
+		close(r->fd);
+
+	memset(r, 0, sizeof(*r));
+	r->fd = -1;
+}
+
+int uring_register(struct uring *r, unsigned int op, const void *arg,
+                   unsigned int nr)
+{
+	if (syscall(__NR_io_uring_register, r->fd, op, arg, nr) < 0)
+		return -errno;
+
+	return 0;
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring *r)
+{
+	unsigned int head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	struct io_uring_sqe *sqe;
+
+	if (r->sqe_tail - head > *r->sq_mask)
+		return NULL;
+
+	sqe = &r->sqes[(r->sqe_tail & *r->sq_mask) << r->sqe_shift];
+	memset(sqe, 0, sizeof(*sqe) << r->sqe_shift);
+	r->sqe_tail++;
+	return sqe;
+}
+
+int uring_submit(struct uring *r, unsigned int wait_nr)
+{
+	unsigned int to_submit = r->sqe_tail - *r->sq_tail;
+	unsigned int flags = 0;
+	int ret;
+
+	__atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+
+	if (r->flags & IORING_SETUP_SQPOLL) {
+		/* Poller thread picks SQEs up, only kick it if it went idle */
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (__atomic_load_n(r->sq_flags, __ATOMIC_RELAXED) &
+		    IORING_SQ_NEED_WAKEUP)
+			flags |= IORING_ENTER_SQ_WAKEUP;
+	}
+
+	/* Polled completions are only reaped from io_uring_enter() */
+	if (wait_nr || (r->flags & IORING_SETUP_IOPOLL))
+		flags |= IORING_ENTER_GETEVENTS;
+
+	if (!flags && (r->flags & IORING_SETUP_SQPOLL))
+		return to_submit;
+	if (!flags && !to_submit)
+		return 0;
+
+	do {
+		ret = sys_io_uring_enter(r->fd, to_submit, wait_nr, flags);
+	} while (ret < 0 && errno == EINTR);
+
+	return ret < 0 ? -errno : ret;
+}
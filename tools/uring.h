@@ -0,0 +1,64 @@
+#ifndef SBDD_TOOLS_URING_H
+#define SBDD_TOOLS_URING_H
+
+/*
+Minimal raw io_uring wrapper for the sbdd tools. liburing would do the same,
+but it is one more dependency to carry around test machines and it hides the
+exact syscalls issued, which is what we want to control when measuring sbdd.
+*/
+
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+struct uring {
+	int                     fd;
+	unsigned int            flags;
+	unsigned int            sqe_shift;
+	unsigned int            sqe_tail;
+
+	unsigned int            *sq_head;
+	unsigned int            *sq_tail;
+	unsigned int            *sq_mask;
+	unsigned int            *sq_flags;
+	unsigned int            *sq_array;
+	struct io_uring_sqe     *sqes;
+
+	unsigned int            *cq_head;
+	unsigned int            *cq_tail;
+	unsigned int            *cq_mask;
+	struct io_uring_cqe     *cqes;
+
+	void                    *sq_ring;
+	size_t                  sq_ring_sz;
+	void                    *cq_ring;
+	size_t                  cq_ring_sz;
+	size_t                  sqes_sz;
+};
+
+int uring_init(struct uring *r, unsigned int entries, struct io_uring_params *p);
+void uring_exit(struct uring *r);
+int uring_register(struct uring *r, unsigned int op, const void *arg,
+                   unsigned int nr);
+
+/* Returns NULL when the SQ is full */
+struct io_uring_sqe *uring_get_sqe(struct uring *r);
+
+/* Publishes queued SQEs and waits for at least wait_nr completions */
+int uring_submit(struct uring *r, unsigned int wait_nr);
+
+static inline struct io_uring_cqe *uring_peek_cqe(struct uring *r)
+{
+	unsigned int head = *r->cq_head;
+
+	if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	return &r->cqes[head & *r->cq_mask];
+}
+
+static inline void uring_cqe_seen(struct uring *r)
+{
+	__atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+#endif /* SBDD_TOOLS_URING_H */